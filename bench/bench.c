@@ -0,0 +1,93 @@
+#include "bench.h"
+#include "inet6.h"
+#include <string.h>
+#include <unistd.h>
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char *bench_tmpfile(const char *prefix) {
+    const char *tmpdir = getenv("TMPDIR");
+    char *path = malloc(256);
+    snprintf(path, 256, "%s/%s-XXXXXX", tmpdir ? tmpdir : "/tmp", prefix);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        FATAL("Cannot create temporary file %s", path);
+    close(fd);
+    unlink(path);
+    return path;
+}
+
+void bench_rmfile(const char *storage) {
+    char path[strlen(storage) + 5];
+    unlink(storage);
+    sprintf(path, "%s-wal", storage);
+    unlink(path);
+    sprintf(path, "%s-shm", storage);
+    unlink(path);
+}
+
+static uint32_t xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Fill a trunk resembling real traffic: a handful of users
+// talking to a limited set of destinations, a few packets per second.
+// Given an IPv6 address table, about one entry in eight is IPv6.
+Entry *bench_make_trunk(Header *h, Inet6Table *daddrs6, uint32_t nr_entries,
+                        uint32_t seed) {
+    Entry *store = calloc(nr_entries, sizeof(Entry));
+    uint32_t state = seed * 2654435761u + 1;
+    int64_t t = (1500000000 + (int64_t)seed * 3600) * 1000;
+
+    for (uint32_t i = 0; i < nr_entries; ++i) {
+        Entry *e = &store[i];
+        uint32_t r = xorshift(&state);
+        t += (r & 0x7) == 0 ? r % 1000 : r % 16;
+        e->timestamp = t / 1000;
+        e->msec = t % 1000;
+        e->uid = 1000 + (r >> 3) % 8;
+        e->ip_version = 4;
+        e->daddr.s_addr = htonl(0x0a000000 | ((r >> 6) % 64));
+        if (daddrs6 && !((r >> 25) & 0x7)) {
+            struct in6_addr addr = {.s6_addr = {0x20, 0x01, 0x0d, 0xb8}};
+            addr.s6_addr[15] = (r >> 6) % 64;
+            e->ip_version = 6;
+            e->daddr.s_addr = inet6_table_add(daddrs6, &addr);
+        }
+        e->protocol = (r >> 12) & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+        e->sport = 32768 + (xorshift(&state) % 28232);
+        e->dport = (r >> 13) & 1 ? 443 : 53 + ((r >> 14) % 4) * 1000;
+        e->count = (r >> 16) & 0x7 ? 1 : 2 + (r >> 19) % 64;
+    }
+
+    memset(h, 0, sizeof(Header));
+    h->nr_entries = nr_entries;
+    h->raw_size = nr_entries * sizeof(Entry);
+    h->start_time = store[0].timestamp;
+    h->end_time = store[nr_entries - 1].timestamp;
+    return store;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void bench_report(const char *name, double *samples, uint32_t n) {
+    double sum = 0;
+    for (uint32_t i = 0; i < n; ++i)
+        sum += samples[i];
+    qsort(samples, n, sizeof(double), cmp_double);
+
+    printf("%-24s mean %8.3f ms  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n",
+           name, sum / n * 1e3, samples[n / 2] * 1e3,
+           samples[(uint32_t)(n * 0.99)] * 1e3, samples[n - 1] * 1e3);
+}
@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "main.h"
+
+double bench_now(void);
+char *bench_tmpfile(const char *prefix);
+void bench_rmfile(const char *storage);
+Entry *bench_make_trunk(Header *h, Inet6Table *daddrs6, uint32_t nr_entries,
+                        uint32_t seed);
+void bench_report(const char *name, double *samples, uint32_t n);
+
+#endif // BENCH_H
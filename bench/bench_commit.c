@@ -0,0 +1,148 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2018 Yun-Chih Chen
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Measure the latency of committing one trunk to the database,
+// either reopening the database for every trunk (what the commit
+// path used to do), reusing one long-lived DBWriter, or grouping
+// several trunks in one transaction.
+
+#include "bench.h"
+#include "main.h"
+#include "sql.h"
+
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+
+const char *help_text =
+    "Usage: bench_commit [OPTION]\n"
+    "\n"
+    "Options:\n"
+    "  -d --storage=<filename>    sqlite database file (default: temporary)\n"
+    "  -n --nr_commits=<n>        number of trunks to commit (default: 200)\n"
+    "  -b --commit_batch=<n>      trunks per transaction for group commit "
+    "(default: 8)\n"
+    "  -h --help                  print this help\n"
+    "\n";
+
+static void bench_reopen(const char *storage, const Header *h,
+                         const Entry *store, uint32_t n, double *lat) {
+    for (uint32_t i = 0; i < n; ++i) {
+        DBWriter w;
+        double start = bench_now();
+        db_writer_open(&w, storage);
+        db_insert(&w, h, store);
+        db_writer_close(&w);
+        lat[i] = bench_now() - start;
+    }
+}
+
+static void bench_persistent(const char *storage, const Header *h,
+                             const Entry *store, uint32_t n, double *lat) {
+    DBWriter w;
+    db_writer_open(&w, storage);
+    for (uint32_t i = 0; i < n; ++i) {
+        double start = bench_now();
+        db_insert(&w, h, store);
+        lat[i] = bench_now() - start;
+    }
+    db_writer_close(&w);
+}
+
+// Latency of a group commit is amortized over the trunks of the batch
+static void bench_grouped(const char *storage, const Header *h,
+                          const Entry *store, uint32_t n, uint32_t batch,
+                          double *lat) {
+    DBWriter w;
+    db_writer_open(&w, storage);
+    for (uint32_t i = 0; i < n; i += batch) {
+        uint32_t m = n - i < batch ? n - i : batch;
+        double start = bench_now();
+        db_begin(w.db);
+        for (uint32_t j = 0; j < m; ++j)
+            db_insert(&w, h, store);
+        db_end(w.db);
+        double elapsed = bench_now() - start;
+        for (uint32_t j = 0; j < m; ++j)
+            lat[i + j] = elapsed / m;
+    }
+    db_writer_close(&w);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t nr_commits = 200, commit_batch = g_commit_batch_default;
+    char *storage = NULL;
+
+    struct option longopts[] = {{"storage", required_argument, NULL, 'd'},
+                                {"nr_commits", required_argument, NULL, 'n'},
+                                {"commit_batch", required_argument, NULL, 'b'},
+                                {"help", no_argument, NULL, 'h'},
+                                {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:d:n:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            printf("%s", help_text);
+            exit(0);
+        case 'd':
+            storage = strdup(optarg);
+            break;
+        case 'n':
+            nr_commits = atoi(optarg);
+            break;
+        case 'b':
+            commit_batch = atoi(optarg);
+            break;
+        case '?':
+            FATAL("Unknown argument, see --help");
+        }
+    }
+    ASSERT(nr_commits > 0, "nr_commits must be positive\n");
+    ASSERT(commit_batch > 0, "commit_batch must be positive\n");
+
+    bool tmp_storage = !storage;
+    if (tmp_storage)
+        storage = bench_tmpfile("bench_commit");
+
+    Header h = {0};
+    Entry *store = bench_make_trunk(&h, NULL, g_max_nr_entries_default, 0);
+    double *lat = malloc(sizeof(double) * nr_commits);
+
+    printf("committing %u trunks of %u entries (%.2f KB) to %s\n", nr_commits,
+           h.nr_entries, h.raw_size / 1024.0, storage);
+
+    bench_reopen(storage, &h, store, nr_commits, lat);
+    bench_report("reopen per commit", lat, nr_commits);
+    bench_persistent(storage, &h, store, nr_commits, lat);
+    bench_report("persistent writer", lat, nr_commits);
+    bench_grouped(storage, &h, store, nr_commits, commit_batch, lat);
+    bench_report("group commit", lat, nr_commits);
+
+    if (tmp_storage)
+        bench_rmfile(storage);
+    free(lat);
+    free(store);
+    free(storage);
+    return 0;
+}
@@ -0,0 +1,152 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2018 Yun-Chih Chen
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compress trunks with every compression algorithm through the commit
+// path, then extract them back, reporting compression ratio and
+// throughput.  Any trunk not extracted back to its original entries
+// fails the benchmark.
+
+#include "bench.h"
+#include "commit.h"
+#include "extract.h"
+#include "inet6.h"
+#include "main.h"
+#include "util.h"
+
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+
+const char *help_text =
+    "Usage: bench_compress [OPTION]\n"
+    "\n"
+    "Options:\n"
+    "  -n --nr_trunks=<n>         number of trunks to compress (default: 50)\n"
+    "  -h --help                  print this help\n"
+    "\n";
+
+static const char *algorithms[] = {"none", "lz4", "lz4hc", "zstd"};
+
+static void bench_algorithm(const char *storage, const char *name,
+                            uint32_t nr_trunks) {
+    static Global g;
+    Committer c;
+    ExtractContext ctx;
+    Header h, out_header;
+    State s = {.header = &h, .global = &g}, out = {.header = &out_header};
+    double *lat_c = malloc(sizeof(double) * nr_trunks);
+    double *lat_d = malloc(sizeof(double) * nr_trunks);
+    uint64_t raw = 0, compressed = 0;
+
+    g.compression_type = get_compression(strcmp(name, "none") ? name : NULL);
+    g.max_nr_entries = g_max_nr_entries_default;
+    g.commit_batch = 1;
+    g.storage_file = storage;
+    committer_init(&c, &g);
+    extract_init(&ctx);
+    inet6_table_init(&s.daddrs6, NULL, g.max_nr_entries, true);
+
+    for (uint32_t i = 0; i < nr_trunks; ++i) {
+        inet6_table_clear(&s.daddrs6);
+        s.store = bench_make_trunk(&h, &s.daddrs6, g.max_nr_entries, i);
+        h.compression_type = g.compression_type;
+        raw += h.raw_size;
+
+        double start = bench_now();
+        void *blob = compress_trunk(&c, &s, 0);
+        lat_c[i] = bench_now() - start;
+        compressed += h.raw_size;
+
+        out_header = h;
+        out.store = NULL;
+        start = bench_now();
+        bool ok = extract(&ctx, &out, blob);
+        lat_d[i] = bench_now() - start;
+
+        if (!ok || memcmp(out.store, s.store, h.nr_entries * sizeof(Entry)) ||
+            out.daddrs6.size != s.daddrs6.size ||
+            memcmp(out.daddrs6.addrs, s.daddrs6.addrs,
+                   s.daddrs6.size * sizeof(struct in6_addr)))
+            FATAL("%s: trunk #%u does not round trip", name, i);
+        free(out.store);
+        free(s.store);
+    }
+
+    double total_c = 0, total_d = 0;
+    for (uint32_t i = 0; i < nr_trunks; ++i) {
+        total_c += lat_c[i];
+        total_d += lat_d[i];
+    }
+    printf("%-6s ratio %6.2f  compress %8.1f MB/s  decompress %8.1f MB/s\n",
+           name, (double)raw / compressed, raw / total_c / 1024 / 1024,
+           raw / total_d / 1024 / 1024);
+
+    char label[64];
+    sprintf(label, "%s compress", name);
+    bench_report(label, lat_c, nr_trunks);
+    sprintf(label, "%s decompress", name);
+    bench_report(label, lat_d, nr_trunks);
+
+    inet6_table_destroy(&s.daddrs6);
+    inet6_table_destroy(&out.daddrs6);
+    extract_destroy(&ctx);
+    committer_destroy(&c);
+    free(lat_c);
+    free(lat_d);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t nr_trunks = 50;
+
+    struct option longopts[] = {{"nr_trunks", required_argument, NULL, 'n'},
+                                {"help", no_argument, NULL, 'h'},
+                                {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            printf("%s", help_text);
+            exit(0);
+        case 'n':
+            nr_trunks = atoi(optarg);
+            break;
+        case '?':
+            FATAL("Unknown argument, see --help");
+        }
+    }
+    ASSERT(nr_trunks > 0, "nr_trunks must be positive\n");
+
+    // The committer needs a database, though nothing is stored in it
+    char *storage = bench_tmpfile("bench_compress");
+    printf("compressing %u trunks of %u entries (%.2f KB)\n", nr_trunks,
+           g_max_nr_entries_default,
+           g_max_nr_entries_default * sizeof(Entry) / 1024.0);
+
+    for (uint32_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); ++i)
+        bench_algorithm(storage, algorithms[i], nr_trunks);
+
+    bench_rmfile(storage);
+    free(storage);
+    return 0;
+}
@@ -0,0 +1,166 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2018 Yun-Chih Chen
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compare the lines per second of the text output of nfextract with
+// the printf based formatting it used to do, and check that both
+// produce the same bytes.
+
+#include "bench.h"
+#include "inet6.h"
+#include "main.h"
+#include "output.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+
+const char *help_text =
+    "Usage: bench_format [OPTION]\n"
+    "\n"
+    "Options:\n"
+    "  -n --nr_trunks=<n>         number of trunks to format (default: 50)\n"
+    "  -h --help                  print this help\n"
+    "\n";
+
+// The text output of nfextract, as printf would format it
+static void format_printf(FILE *out, const State *s, uint32_t n) {
+    const Entry *store = s->store;
+    time_t last_t = 0;
+    char timestamp[20], daddr[INET6_ADDRSTRLEN];
+    for (uint32_t i = 0; i < n; ++i) {
+        if (last_t != store[i].timestamp || !last_t) {
+            last_t = store[i].timestamp;
+            strftime(timestamp, 20, OUTPUT_DATE_FORMAT, localtime(&last_t));
+        }
+        if (store[i].ip_version == 6)
+            inet_ntop(AF_INET6, &s->daddrs6.addrs[store[i].daddr.s_addr],
+                      daddr, sizeof(daddr));
+        else
+            inet_ntop(AF_INET, &store[i].daddr, daddr, sizeof(daddr));
+
+        fprintf(out,
+                "  "
+                "%s.%03u:\t"
+                "daddr=%-16s\t"
+                "proto=%s\t"
+                "uid=%d\t"
+                "sport=%d\t"
+                "dport=%d\t"
+                "count=%u\n",
+                timestamp, store[i].msec, daddr,
+                store[i].protocol == IPPROTO_TCP ? "TCP" : "UDP",
+                store[i].uid, store[i].sport, store[i].dport, store[i].count);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t nr_trunks = 50;
+
+    struct option longopts[] = {{"nr_trunks", required_argument, NULL, 'n'},
+                                {"help", no_argument, NULL, 'h'},
+                                {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            printf("%s", help_text);
+            exit(0);
+        case 'n':
+            nr_trunks = atoi(optarg);
+            break;
+        case '?':
+            FATAL("Unknown argument, see --help");
+        }
+    }
+    ASSERT(nr_trunks > 0, "nr_trunks must be positive\n");
+
+    uint32_t nr_entries = g_max_nr_entries_default;
+    uint64_t nr_lines = (uint64_t)nr_trunks * nr_entries;
+    uint32_t *sel = malloc(sizeof(uint32_t) * nr_entries);
+    for (uint32_t i = 0; i < nr_entries; ++i)
+        sel[i] = i;
+    State *states = calloc(nr_trunks, sizeof(State));
+    for (uint32_t i = 0; i < nr_trunks; ++i) {
+        Header h;
+        inet6_table_init(&states[i].daddrs6, NULL, nr_entries, true);
+        states[i].store =
+            bench_make_trunk(&h, &states[i].daddrs6, nr_entries, i);
+    }
+
+    // Check the output is the same, byte for byte
+    char *expected = NULL, *path = bench_tmpfile("bench_format");
+    size_t expected_size = 0;
+    FILE *mem = open_memstream(&expected, &expected_size);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    Writer w;
+    writer_init(&w, fd, OUTPUT_BUFFER_SIZE);
+    for (uint32_t i = 0; i < nr_trunks; ++i) {
+        format_printf(mem, &states[i], nr_entries);
+        output_entries(&w, OUTPUT_TEXT, &states[i], sel, nr_entries);
+    }
+    fclose(mem);
+    writer_flush(&w);
+
+    size_t size = lseek(fd, 0, SEEK_END);
+    char *actual = malloc(size);
+    if (pread(fd, actual, size, 0) != (ssize_t)size || size != expected_size ||
+        memcmp(actual, expected, size))
+        FATAL("text output differs from printf");
+    writer_destroy(&w);
+    close(fd);
+    unlink(path);
+    free(actual);
+    free(expected);
+    free(path);
+
+    printf("formatting %lu lines (%.2f MB)\n", nr_lines,
+           expected_size / 1024.0 / 1024.0);
+
+    FILE *null = fopen("/dev/null", "w");
+    double start = bench_now();
+    for (uint32_t i = 0; i < nr_trunks; ++i)
+        format_printf(null, &states[i], nr_entries);
+    double elapsed = bench_now() - start;
+    printf("%-10s %12.0f lines/s\n", "printf", nr_lines / elapsed);
+    fclose(null);
+
+    writer_init(&w, open("/dev/null", O_WRONLY), OUTPUT_BUFFER_SIZE);
+    start = bench_now();
+    for (uint32_t i = 0; i < nr_trunks; ++i)
+        output_entries(&w, OUTPUT_TEXT, &states[i], sel, nr_entries);
+    writer_flush(&w);
+    elapsed = bench_now() - start;
+    printf("%-10s %12.0f lines/s\n", "formatter", nr_lines / elapsed);
+    close(w.fd);
+    writer_destroy(&w);
+
+    for (uint32_t i = 0; i < nr_trunks; ++i) {
+        free(states[i].store);
+        inet6_table_destroy(&states[i].daddrs6);
+    }
+    free(states);
+    free(sel);
+    return 0;
+}
@@ -0,0 +1,424 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2018 Yun-Chih Chen
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Measure the throughput of nfcollect without a kernel: synthetic NFLOG
+// packets go through collect_packet, the parsing path of handle_packet,
+// into trunks of the trunk pool, which the commit worker compresses and
+// commits to a temporary database.  Reports packets per second, CPU time
+// per packet and the latency from a trunk being queued until committed.
+
+#include "bench.h"
+#include "collect.h"
+#include "commit.h"
+#include "flow.h"
+#include "main.h"
+#include "pool.h"
+#include "stats.h"
+#include "util.h"
+
+#include <getopt.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+const char *help_text =
+    "Usage: bench_ingest [OPTION]\n"
+    "\n"
+    "Options:\n"
+    "  -n --nr_packets=<n>        packets fed to each group (default: "
+    "2000000)\n"
+    "  -g --nr_groups=<n>         NFLOG groups, each fed by its own receive "
+    "worker (default: 1)\n"
+    "  -r --rate=<packets/s>      packet rate of each group the timestamps "
+    "follow (default: 100000)\n"
+    "  -F --nr_flows=<n>          distinct flows of the traffic (default: "
+    "10000)\n"
+    "  -6 --ipv6=<percent>        share of IPv6 packets (default: 10)\n"
+    "  -u --udp=<percent>         share of UDP packets (default: 30)\n"
+    "  -a --ack=<percent>         share of TCP packets that are ACK-only, "
+    "hence filtered (default: 50)\n"
+    "  -f --flow_window=<ms>      count further packets of a flow in its "
+    "entry for this long (default: 4000)\n"
+    "  -c --compression=<algo>    compression algorithm to use: lz4, lz4hc "
+    "or zstd (default: no compression)\n"
+    "  -l --compression_level=<n> compression level (zstd, lz4hc)\n"
+    "  -b --commit_batch=<n>      maximum number of trunks committed in one "
+    "transaction (default: 8)\n"
+    "  -p --nr_trunks=<n>         number of preallocated trunks (default: 3 "
+    "per group)\n"
+    "  -d --storage=<filename>    sqlite database file (default: temporary)\n"
+    "  -h --help                  print this help\n"
+    "\n";
+
+// Packets of each group are taken in turn from this many distinct ones
+#define BENCH_NR_DISTINCT_PACKETS 65536
+// Room for an IPv6 and a TCP header
+#define BENCH_PAYLOAD_SIZE 64
+
+typedef struct _Traffic {
+    uint32_t nr_flows;
+    uint32_t rate;
+    // Percentages
+    uint32_t ipv6, udp, ack;
+} Traffic;
+
+// A receive worker and the packets it is fed
+typedef struct _Feeder {
+    Global *g;
+    Netlink nl;
+    NflogPacket *packets;
+    char *payloads;
+    uint32_t nr_packets;
+    uint32_t rate;
+    // CPU time (s) the receive worker took
+    double cpu;
+    pthread_t thread;
+} Feeder;
+
+static uint32_t xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Build the packet of a random flow of the traffic.  The fields of a flow
+// only depend on its number, so that its packets can be told apart by
+// the flow table; only TCP flags vary between them.
+static void make_packet(NflogPacket *p, char *payload, const Traffic *t,
+                        uint32_t *state) {
+    uint32_t flow = xorshift(state) % t->nr_flows;
+    uint32_t h = flow * 2654435761u + 1, r = xorshift(state);
+    bool ipv6 = xorshift(&h) % 100 < t->ipv6;
+    bool udp = xorshift(&h) % 100 < t->udp;
+    uint16_t sport = 32768 + xorshift(&h) % 28232;
+    uint16_t dport = (h >> 8) & 1 ? 443 : 53 + (h >> 9) % 4 * 1000;
+    uint32_t daddr = xorshift(&h) % 4096;
+    char *inner;
+
+    memset(payload, 0, BENCH_PAYLOAD_SIZE);
+    if (ipv6) {
+        struct ip6_hdr *ip6h = (struct ip6_hdr *)payload;
+        ip6h->ip6_vfc = 0x60;
+        ip6h->ip6_nxt = udp ? IPPROTO_UDP : IPPROTO_TCP;
+        ip6h->ip6_dst.s6_addr[0] = 0x20;
+        ip6h->ip6_dst.s6_addr[1] = 0x01;
+        ip6h->ip6_dst.s6_addr[2] = 0x0d;
+        ip6h->ip6_dst.s6_addr[3] = 0xb8;
+        memcpy(&ip6h->ip6_dst.s6_addr[12], &daddr, sizeof(daddr));
+        inner = payload + sizeof(struct ip6_hdr);
+    } else {
+        struct iphdr *iph = (struct iphdr *)payload;
+        iph->version = 4;
+        iph->ihl = 5;
+        iph->protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+        iph->daddr = htonl(0x0a000000 | daddr);
+        inner = payload + sizeof(struct iphdr);
+    }
+
+    if (udp) {
+        struct udphdr *udph = (struct udphdr *)inner;
+        udph->source = htons(sport);
+        udph->dest = htons(dport);
+        p->payload_len = inner - payload + sizeof(struct udphdr);
+    } else {
+        struct tcphdr *tcph = (struct tcphdr *)inner;
+        tcph->source = htons(sport);
+        tcph->dest = htons(dport);
+        tcph->ack = 1;
+        if (r % 100 >= t->ack) {
+            tcph->syn = r & 1;
+            tcph->psh = !tcph->syn;
+        }
+        p->payload_len = inner - payload + sizeof(struct tcphdr);
+    }
+
+    p->payload = payload;
+    p->has_seq = p->has_timestamp = p->has_uid = true;
+    p->uid = 1000 + xorshift(&h) % 64;
+}
+
+static void feeder_init(Feeder *f, Global *g, uint16_t group_id,
+                        uint32_t nr_packets, const Traffic *t) {
+    uint32_t nr_distinct = nr_packets < BENCH_NR_DISTINCT_PACKETS
+                               ? nr_packets
+                               : BENCH_NR_DISTINCT_PACKETS;
+    uint32_t state = group_id * 2654435761u + 1;
+
+    memset(f, 0, sizeof(Feeder));
+    f->g = g;
+    f->nl.group_id = group_id;
+    flow_table_init(&f->nl.flows, g_flow_table_size);
+    f->nr_packets = nr_packets;
+    f->rate = t->rate;
+    f->packets = calloc(nr_distinct, sizeof(NflogPacket));
+    f->payloads = malloc((size_t)nr_distinct * BENCH_PAYLOAD_SIZE);
+    for (uint32_t i = 0; i < nr_distinct; ++i)
+        make_packet(&f->packets[i], f->payloads + i * BENCH_PAYLOAD_SIZE, t,
+                    &state);
+}
+
+static void feeder_destroy(Feeder *f) {
+    flow_table_destroy(&f->nl.flows);
+    free(f->packets);
+    free(f->payloads);
+}
+
+static double thread_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time of the i-th packet fed by `f`, as if packets arrived at `rate`
+// packets per second from `start`
+static struct timeval feed_time(const Feeder *f, const struct timeval *start,
+                                uint32_t i) {
+    uint64_t usec = start->tv_usec + (uint64_t)i * 1000000 / f->rate;
+    return (struct timeval){.tv_sec = start->tv_sec + usec / 1000000,
+                            .tv_usec = usec % 1000000};
+}
+
+// What a receive worker does, with packets taken from memory instead of
+// the netlink socket.  The packet times end before the run starts, so
+// that trunks are stamped with the times of their entries and nfextract
+// finds them in the database left behind.
+static void *feed(void *targs) {
+    Feeder *f = (Feeder *)targs;
+    Global *g = f->g;
+    uint32_t nr_distinct = f->nr_packets < BENCH_NR_DISTINCT_PACKETS
+                               ? f->nr_packets
+                               : BENCH_NR_DISTINCT_PACKETS;
+    struct timeval start;
+    uint32_t i = 0;
+
+    gettimeofday(&start, NULL);
+    start.tv_sec -= f->nr_packets / f->rate + 1;
+    double cpu = thread_cpu_time();
+    while (i < f->nr_packets) {
+        State *s = trunk_pool_get(g);
+        s->netlink_fd = &f->nl;
+        collect_begin(s);
+        s->header->start_time = feed_time(f, &start, i).tv_sec;
+        for (; i < f->nr_packets && s->header->nr_entries < g->max_nr_entries;
+             ++i) {
+            NflogPacket *p = &f->packets[i % nr_distinct];
+            p->seq = i;
+            p->timestamp = feed_time(f, &start, i);
+            collect_packet(s, p);
+        }
+        collect_end(s);
+    }
+    f->cpu = thread_cpu_time() - cpu;
+    return NULL;
+}
+
+static double process_cpu_time(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Upper bound (ms) of the bucket holding the given share of the samples
+static double histogram_quantile(const LatencyHistogram *h, double q) {
+    uint64_t rank = h->count * q, cumulative = 0;
+    for (uint32_t i = 0; i < g_stats_nr_buckets; ++i) {
+        cumulative += h->buckets[i];
+        if (cumulative > rank)
+            return (1ULL << i) / 1e3;
+    }
+    return (1ULL << (g_stats_nr_buckets - 1)) / 1e3;
+}
+
+static void report_histogram(const char *name, const LatencyHistogram *h) {
+    if (!h->count)
+        return;
+    printf("%-24s mean %8.3f ms  p50 <= %8.3f ms  p99 <= %8.3f ms\n", name,
+           (double)h->sum_usec / h->count / 1e3, histogram_quantile(h, 0.5),
+           histogram_quantile(h, 0.99));
+}
+
+int main(int argc, char *argv[]) {
+    static Global g;
+    uint32_t nr_packets = 2000000, nr_groups = 1, nr_trunks = 0;
+    Traffic t = {.nr_flows = 10000, .rate = 100000, .ipv6 = 10, .udp = 30,
+                 .ack = 50};
+    char *compression_flag = NULL, *storage = NULL;
+
+    struct option longopts[] = {
+        {"nr_packets", required_argument, NULL, 'n'},
+        {"nr_groups", required_argument, NULL, 'g'},
+        {"rate", required_argument, NULL, 'r'},
+        {"nr_flows", required_argument, NULL, 'F'},
+        {"ipv6", required_argument, NULL, '6'},
+        {"udp", required_argument, NULL, 'u'},
+        {"ack", required_argument, NULL, 'a'},
+        {"flow_window", required_argument, NULL, 'f'},
+        {"compression", required_argument, NULL, 'c'},
+        {"compression_level", required_argument, NULL, 'l'},
+        {"commit_batch", required_argument, NULL, 'b'},
+        {"nr_trunks", required_argument, NULL, 'p'},
+        {"storage", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+
+    g.flow_window = g_flow_window_default;
+    g.commit_batch = g_commit_batch_default;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:g:r:F:6:u:a:f:c:l:b:p:d:h",
+                              longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            printf("%s", help_text);
+            exit(0);
+        case 'n':
+            nr_packets = atoi(optarg);
+            break;
+        case 'g':
+            nr_groups = atoi(optarg);
+            break;
+        case 'r':
+            t.rate = atoi(optarg);
+            break;
+        case 'F':
+            t.nr_flows = atoi(optarg);
+            break;
+        case '6':
+            t.ipv6 = atoi(optarg);
+            break;
+        case 'u':
+            t.udp = atoi(optarg);
+            break;
+        case 'a':
+            t.ack = atoi(optarg);
+            break;
+        case 'f':
+            g.flow_window = atoi(optarg);
+            break;
+        case 'c':
+            compression_flag = optarg;
+            break;
+        case 'l':
+            g.compression_level = atoi(optarg);
+            break;
+        case 'b':
+            g.commit_batch = atoi(optarg);
+            break;
+        case 'p':
+            nr_trunks = atoi(optarg);
+            break;
+        case 'd':
+            storage = strdup(optarg);
+            break;
+        case '?':
+            FATAL("Unknown argument, see --help");
+        }
+    }
+    ASSERT(nr_packets > 0 && nr_groups > 0 && t.nr_flows > 0 && t.rate > 0,
+           "nr_packets, nr_groups, nr_flows and rate must be positive\n");
+    ASSERT(g.commit_batch > 0, "commit_batch must be positive\n");
+
+    bool tmp_storage = !storage;
+    if (tmp_storage)
+        storage = bench_tmpfile("bench_ingest");
+    g.compression_type = get_compression(compression_flag);
+    ASSERT(g.compression_type != COMPRESS_ZSTD ||
+               (g.compression_level >= ZSTD_minCLevel() &&
+                g.compression_level <= ZSTD_maxCLevel()),
+           "compression_level out of the range of zstd\n");
+    g.storage_file = storage;
+    g.storage_budget = INT64_MAX;
+    pthread_mutex_init(&g.storage_consumed_lock, NULL);
+    pthread_cond_init(&g.gc_cond, NULL);
+    g.max_nr_entries = g_max_nr_entries_default;
+    g.nr_nl_groups = nr_groups;
+    g.nr_trunks = nr_trunks ? nr_trunks
+                            : nr_groups * g_nr_trunks_per_group_default;
+    if (g.nr_trunks <= nr_groups)
+        FATAL("Need more than %u trunks for %u groups", nr_groups, nr_groups);
+    trunk_pool_init(&g);
+
+    Feeder *feeders = malloc(sizeof(Feeder) * nr_groups);
+    for (uint32_t i = 0; i < nr_groups; ++i)
+        feeder_init(&feeders[i], &g, i + 1, nr_packets, &t);
+
+    printf("feeding %u packets to each of %u groups: %u flows, %u%% IPv6, "
+           "%u%% UDP, %u%% of TCP ACK-only, %u packets/s\n",
+           nr_packets, nr_groups, t.nr_flows, t.ipv6, t.udp, t.ack, t.rate);
+
+    pthread_t committer;
+    double start = bench_now(), cpu = process_cpu_time();
+    pthread_create(&committer, NULL, commit_worker, &g);
+    for (uint32_t i = 0; i < nr_groups; ++i)
+        pthread_create(&feeders[i].thread, NULL, feed, &feeders[i]);
+    for (uint32_t i = 0; i < nr_groups; ++i)
+        pthread_join(feeders[i].thread, NULL);
+    double ingested = bench_now() - start;
+    trunk_queue_close(&g.commit_queue);
+    pthread_join(committer, NULL);
+    double committed = bench_now() - start;
+    cpu = process_cpu_time() - cpu;
+
+    CollectStats total = {0};
+    double receive_cpu = 0;
+    for (uint32_t i = 0; i < nr_groups; ++i) {
+        const CollectStats *st = &feeders[i].nl.stats;
+        total.nr_packets += st->nr_packets;
+        total.nr_stored += st->nr_stored;
+        total.nr_rate_limited += st->nr_rate_limited;
+        receive_cpu += feeders[i].cpu;
+    }
+    uint64_t nr_filtered =
+        total.nr_packets - total.nr_stored - total.nr_rate_limited;
+    printf("%lu packets: %lu stored, %lu rate-limited, %lu filtered\n",
+           (unsigned long)total.nr_packets, (unsigned long)total.nr_stored,
+           (unsigned long)total.nr_rate_limited, (unsigned long)nr_filtered);
+
+    const Stats *st = &g.stats;
+    printf("%lu trunks committed, encoding ratio %.2f, compression ratio "
+           "%.2f, receive workers waited for a trunk %lu times\n",
+           (unsigned long)st->nr_trunks_committed,
+           st->encoded_bytes ? (double)st->raw_bytes / st->encoded_bytes : 0,
+           st->compressed_bytes
+               ? (double)st->encoded_bytes / st->compressed_bytes
+               : 0,
+           (unsigned long)g.nr_pool_stalls);
+    printf("receive      %10.0f packets/s  %8.1f ns CPU/packet\n",
+           total.nr_packets / ingested, receive_cpu / total.nr_packets * 1e9);
+    printf("end to end   %10.0f packets/s  %8.1f ns CPU/packet\n",
+           total.nr_packets / committed, cpu / total.nr_packets * 1e9);
+    report_histogram("compress", &st->compress_latency);
+    report_histogram("insert", &st->insert_latency);
+    report_histogram("queued to committed", &st->commit_latency);
+
+    for (uint32_t i = 0; i < nr_groups; ++i)
+        feeder_destroy(&feeders[i]);
+    free(feeders);
+    trunk_pool_destroy(&g);
+    if (tmp_storage)
+        bench_rmfile(storage);
+    free(storage);
+    return 0;
+}
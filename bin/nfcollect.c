@@ -24,11 +24,17 @@
 // SOFTWARE.
 
 #include "collect.h"
+#include "commit.h"
+#include "gc.h"
+#include "pool.h"
 #include "sql.h"
+#include "staging.h"
+#include "stats.h"
 #include "util.h"
 #include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <lz4hc.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
@@ -42,44 +48,106 @@ const char *help_text =
     "Usage: " PACKAGE " [OPTION]\n"
     "\n"
     "Options:\n"
-    "  -c --compression=<algo>      compression algorithm to use (default: no "
-    "compression)\n"
+    "  -a --max_trunk_age=<seconds>    commit trunks this old even if not "
+    "full, 0 to only commit full trunks (default: 300)\n"
+    "  -b --commit_batch=<n>           maximum number of trunks committed in "
+    "one transaction (default: 8)\n"
+    "  -c --compression=<algo>         compression algorithm to use: lz4, "
+    "lz4hc or zstd (default: no compression)\n"
     "  -d --storage=<filename>         sqlite database storage file\n"
+    "  -f --flow_window=<ms>           count further packets of a flow in its "
+    "entry for this long, 0 to store every packet (default: 4000)\n"
+    "  -l --compression_level=<n>|adaptive\n"
+    "                                  compression level (zstd, lz4hc), or "
+    "follow the commit backlog (zstd only)\n"
+    "  -m --compression_workers=<n>    zstd worker threads for large trunks "
+    "(default: 0)\n"
     "  -h --help                       print this help\n"
-    "  -g --nflog_group=<id>           the group id to collect\n"
+    "  -i --stats_interval=<seconds>   time between two writes of the "
+    "statistics file (default: 10)\n"
+    "  -n --no_staging                 keep trunks in memory only, instead "
+    "of staging files next to the storage file\n"
+    "  -p --nr_trunks=<n>              number of preallocated trunks "
+    "(default: 3 per group)\n"
+    "  -r --rcvbuf=<KiB>               netlink receive buffer size of each "
+    "group, 0 for the system default (default: 4096)\n"
+    "  -g --nflog_group=<id>[,<id>...] the group id(s) to collect, may be "
+    "repeated\n"
     "  -s --storage_size=<max DB size> maximum DB size in MiB\n"
-    "  -V --vacuum                     vacuum the database on startup\n"
+    "  -S --stats=<filename>           write statistics to this file, in the "
+    "Prometheus text format\n"
+    "  -t --zstd_dict                  compress trunks with a dictionary "
+    "trained from recent trunks (zstd only)\n"
+    "  -V --vacuum[=<seconds>]         vacuum the database on startup, "
+    "incrementally for at most <seconds> if given\n"
     "  -v --version                    print version information\n"
+    "  -w --commit_delay=<ms>          wait up to this long for trunks to "
+    "join a batch (default: 0)\n"
     "\n";
 
-static Netlink netlink_fd;
-static void sig_handler(int signo) {
-    if (signo == SIGHUP) {
-        puts("Terminated due to SIGHUP ...");
-        collect_close_netlink(&netlink_fd);
+static Global g;
+static Netlink *netlink_fds;
+
+// Receive workers notice within g_collect_poll_interval ms, the rest of
+// the shutdown is up to main
+static void sig_handler(__attribute__((unused)) int signo) { g.stop = 1; }
+
+static void *group_worker(void *targs) {
+    Netlink *nl = (Netlink *)targs;
+    State *state;
+
+    // Each NFLOG group is received by its own worker, which keeps
+    // filling trunks taken from the shared pool.  Full trunks are
+    // handed to the commit worker by collect_worker.
+    while (!g.stop) {
+        state = trunk_pool_get(&g);
+        state->netlink_fd = nl;
+        collect_worker(state);
     }
+
+    return NULL;
 }
 
 int main(int argc, char *argv[]) {
-    uint32_t storage_size = 0;
-    Global g;
-    int nflog_group_id = -1;
+    uint32_t storage_size = 0, nr_trunks = 0;
+    uint32_t commit_batch = g_commit_batch_default, commit_delay = 0;
     char *compression_flag = NULL, *storage = NULL;
-    bool do_vacuum = false;
+    bool do_vacuum = false, staging = true;
+    uint32_t vacuum_time_limit = 0;
 
     struct option longopts[] = {/* name, has_args, flag, val */
                                 {"nflog_group", required_argument, NULL, 'g'},
                                 {"storage", required_argument, NULL, 'd'},
                                 {"storage_size", required_argument, NULL, 's'},
-                                {"compression", optional_argument, NULL, 'z'},
+                                {"nr_trunks", required_argument, NULL, 'p'},
+                                {"no_staging", no_argument, NULL, 'n'},
+                                {"commit_batch", required_argument, NULL, 'b'},
+                                {"commit_delay", required_argument, NULL, 'w'},
+                                {"compression", required_argument, NULL, 'c'},
+                                {"flow_window", required_argument, NULL, 'f'},
+                                {"rcvbuf", required_argument, NULL, 'r'},
+                                {"max_trunk_age", required_argument, NULL,
+                                 'a'},
+                                {"zstd_dict", no_argument, NULL, 't'},
+                                {"compression_level", required_argument, NULL,
+                                 'l'},
+                                {"compression_workers", required_argument,
+                                 NULL, 'm'},
                                 {"vacuum", optional_argument, NULL, 'V'},
+                                {"stats", required_argument, NULL, 'S'},
+                                {"stats_interval", required_argument, NULL,
+                                 'i'},
                                 {"help", no_argument, NULL, 'h'},
                                 {"version", no_argument, NULL, 'v'},
                                 {0, 0, 0, 0}};
 
+    g.flow_window = g_flow_window_default;
+    g.rcvbuf_size = g_rcvbuf_size_default;
+    g.max_trunk_age = g_max_trunk_age_default;
+    g.stats_interval = g_stats_interval_default;
     int opt;
-    while ((opt = getopt_long(argc, argv, "c:g:d:s:hVvp:", longopts, NULL)) !=
-           -1) {
+    while ((opt = getopt_long(argc, argv, "a:b:c:f:g:d:i:l:m:nr:s:S:thV::vp:w:",
+                              longopts, NULL)) != -1) {
         switch (opt) {
         case 'h':
             printf("%s", help_text);
@@ -89,20 +157,62 @@ int main(int argc, char *argv[]) {
             printf("%s %s", PACKAGE, VERSION);
             exit(0);
             break;
+        case 'a':
+            g.max_trunk_age = atoi(optarg);
+            break;
         case 'c':
             compression_flag = optarg;
             break;
         case 'd':
             storage = strdup(optarg);
             break;
+        case 'f':
+            g.flow_window = atoi(optarg);
+            break;
         case 'g':
-            nflog_group_id = atoi(optarg);
+            g.nr_nl_groups =
+                get_nflog_groups(optarg, &g.nl_group_ids, g.nr_nl_groups);
             break;
         case 's':
             storage_size = atoi(optarg);
             break;
+        case 'p':
+            nr_trunks = atoi(optarg);
+            break;
+        case 'n':
+            staging = false;
+            break;
+        case 'r':
+            g.rcvbuf_size = atoi(optarg);
+            break;
+        case 'b':
+            commit_batch = atoi(optarg);
+            break;
+        case 'w':
+            commit_delay = atoi(optarg);
+            break;
+        case 't':
+            g.zstd_dict = true;
+            break;
+        case 'l':
+            if (!strcmp(optarg, "adaptive"))
+                g.adaptive_level = true;
+            else
+                g.compression_level = atoi(optarg);
+            break;
+        case 'm':
+            g.compression_workers = atoi(optarg);
+            break;
+        case 'S':
+            g.stats_file = optarg;
+            break;
+        case 'i':
+            g.stats_interval = atoi(optarg);
+            break;
         case 'V':
             do_vacuum = true;
+            if (optarg)
+                vacuum_time_limit = atoi(optarg);
             break;
         case '?':
             fprintf(stderr, "Unknown argument, see --help\n");
@@ -111,50 +221,112 @@ int main(int argc, char *argv[]) {
     }
 
     // verify arguments
-    ASSERT(nflog_group_id != -1,
+    ASSERT(g.nr_nl_groups != 0,
            "You must provide a nflog group (see --help)!\n");
     ASSERT(storage != NULL, "You must provide a storage file (see --help)\n");
     ASSERT(storage_size != 0, "You must provide the desired size of log file "
                               "(in MiB) (see --help)\n");
+    ASSERT(commit_batch != 0, "Commit batch must be at least 1 (see --help)\n");
+    ASSERT(g.stats_interval != 0,
+           "Stats interval must be at least 1 second (see --help)\n");
 
     g.compression_type = get_compression(compression_flag);
+    ASSERT(!g.adaptive_level || g.compression_type == COMPRESS_ZSTD,
+           "Adaptive compression level requires zstd (see --help)\n");
+    ASSERT(g.compression_type != COMPRESS_ZSTD ||
+               (g.compression_level >= ZSTD_minCLevel() &&
+                g.compression_level <= ZSTD_maxCLevel()),
+           "Compression level out of the range of zstd (see --help)\n");
+    ASSERT(g.compression_type != COMPRESS_LZ4HC ||
+               (g.compression_level >= 0 &&
+                g.compression_level <= LZ4HC_CLEVEL_MAX),
+           "Compression level out of the range of lz4hc (see --help)\n");
     if (check_basedir_exist(storage) < 0)
         FATAL("Storage directory: %s does not exist", storage);
 
-    // register signal handler
-    if (signal(SIGHUP, sig_handler) == SIG_ERR)
-        ERROR("Could not set SIGHUP handler");
+    // Stop cleanly on these, committing the trunks being filled.  Not
+    // restarting system calls lets the thread taking the signal notice
+    // at once.
+    struct sigaction sa = {.sa_handler = sig_handler};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) < 0 || sigaction(SIGINT, &sa, NULL) < 0 ||
+        sigaction(SIGTERM, &sa, NULL) < 0)
+        ERROR("Could not set signal handlers");
 
     // Vacuum and get current space consumption
     if (do_vacuum && check_file_exist(storage)) {
         INFO(PACKAGE ": vacuum database on startup");
-        sqlite3 *db = NULL;
-        db_open(&db, storage);
-        db_vacuum(db);
-        db_close(db);
+        gc_vacuum(storage, vacuum_time_limit);
     }
 
     pthread_mutex_init(&g.storage_consumed_lock, NULL);
+    pthread_cond_init(&g.gc_cond, NULL);
     g.storage_budget = storage_size * 1024 * 1024; // MB
     g.storage_consumed = check_file_size(storage);
     g.storage_file = (const char *)storage;
     g.max_nr_entries = g_max_nr_entries_default;
+    g.commit_batch = commit_batch;
+    g.commit_delay = commit_delay;
 
-    collect_open_netlink(&netlink_fd, nflog_group_id);
+    // Commit what a crashed run left in its staging files before the
+    // trunks take them over, even if this run doesn't stage its trunks
+    g.staging = staging;
+    uint32_t nr_recovered = staging_recover(&g);
+    if (nr_recovered)
+        INFO(PACKAGE ": recovered %u trunks from staging files",
+             nr_recovered);
 
-    pthread_t worker;
-    State *state;
+    // Each receive worker holds one trunk at any time, so at least one
+    // more is needed for the commit worker to make progress
+    g.nr_trunks = nr_trunks ? nr_trunks
+                            : g.nr_nl_groups * g_nr_trunks_per_group_default;
+    if (g.nr_trunks <= g.nr_nl_groups)
+        FATAL("Need more than %u trunks for %u nflog groups", g.nr_nl_groups,
+              g.nr_nl_groups);
+    trunk_pool_init(&g);
+
+    netlink_fds = calloc(g.nr_nl_groups, sizeof(Netlink));
+    for (uint16_t i = 0; i < g.nr_nl_groups; ++i)
+        collect_open_netlink(&netlink_fds[i], g.nl_group_ids[i],
+                             g.rcvbuf_size);
+    g.netlinks = netlink_fds;
+
+    pthread_t workers[g.nr_nl_groups], committer, gc, stats;
     INFO(PACKAGE
          ": storing in file '%s' (current size: %.2f MB), capped by %d MiB",
          g.storage_file, (float)g.storage_consumed / 1024.0 / 1024.0,
          storage_size);
-    INFO(PACKAGE ": workers started, entries per block = %d", g.max_nr_entries);
+    INFO(PACKAGE ": %d workers started, entries per block = %d, "
+                 "%d trunks preallocated (%.2f MB)",
+         g.nr_nl_groups, g.max_nr_entries, g.nr_trunks,
+         g.nr_trunks * g.max_nr_entries * sizeof(Entry) / 1024.0 / 1024.0);
+
+    pthread_create(&committer, NULL, commit_worker, &g);
+    pthread_create(&gc, NULL, gc_worker, &g);
+    if (g.stats_file)
+        pthread_create(&stats, NULL, stats_worker, &g);
+    for (uint16_t i = 0; i < g.nr_nl_groups; ++i)
+        pthread_create(&workers[i], NULL, group_worker, &netlink_fds[i]);
+    for (uint16_t i = 0; i < g.nr_nl_groups; ++i)
+        pthread_join(workers[i], NULL);
 
-    while (true) {
-        state_init(&state, &netlink_fd, &g);
-        pthread_create(&worker, NULL, collect_worker, (void *)state);
-        pthread_join(worker, NULL);
+    // Every trunk left has been queued, let the commit worker finish
+    // them, then GC its current round
+    INFO(PACKAGE ": committing the remaining trunks before exiting");
+    trunk_queue_close(&g.commit_queue);
+    pthread_join(committer, NULL);
+    pthread_mutex_lock(&g.storage_consumed_lock);
+    pthread_cond_broadcast(&g.gc_cond);
+    pthread_mutex_unlock(&g.storage_consumed_lock);
+    pthread_join(gc, NULL);
+    if (g.stats_file) {
+        pthread_join(stats, NULL);
+        stats_write(&g);
     }
 
-    collect_close_netlink(&netlink_fd);
+    for (uint16_t i = 0; i < g.nr_nl_groups; ++i)
+        collect_close_netlink(&netlink_fds[i]);
+    trunk_pool_destroy(&g);
+    free(netlink_fds);
+    free(g.nl_group_ids);
 }
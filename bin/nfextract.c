@@ -27,7 +27,10 @@
 #define _POSIX_C_SOURCE 200809 // strdup
 #endif
 
+#include "aggregate.h"
 #include "extract.h"
+#include "filter.h"
+#include "output.h"
 #include "main.h"
 #include "sql.h"
 #include "util.h"
@@ -46,11 +49,10 @@
 #include <unistd.h>
 
 #define PROG "nfextract"
-#define DATE_FORMAT_HUMAN "YYYY-MM-DD [HH:MM][:SS]"
+#define DATE_FORMAT_HUMAN "YYYY-MM-DD [HH:MM][:SS][.mmm]"
 #define DATE_FORMAT "%Y-%m-%d"
 #define DATE_FORMAT_FULL DATE_FORMAT " %H:%M"
 #define DATE_FORMAT_FULL2 DATE_FORMAT " %H:%M:%S"
-#define DATE_FORMAT_OUTPUT DATE_FORMAT_FULL2
 
 const char *help_text =
     "Usage: " PROG " [OPTION]\n"
@@ -58,11 +60,31 @@ const char *help_text =
     "Options:\n"
     "  -d --storage=<dirname>     sqlite storage file\n"
     "  -h --help                  print this help\n"
+    "  -j --jobs=<n>              number of threads decompressing trunks "
+    "(default: 1)\n"
     "  -v --version               print version information\n"
     "  -s --since=<date>          start showing entries on or newer than the "
     "specified date (format: " DATE_FORMAT_HUMAN ")\n"
     "  -u --until=<date>          stop showing entries on or older than the "
     "specified date (format: " DATE_FORMAT_HUMAN ")\n"
+    "  -o --format=<format>       output format: text, csv, json (JSON Lines) "
+    "or binary (default: text)\n"
+    "  -G --group_by=<field>[,<field>...]\n"
+    "                             count packets by time, uid, daddr, dport "
+    "and/or proto instead of showing them\n"
+    "  -b --bucket=<seconds>      width of the time buckets when grouping by "
+    "time (default: 60)\n"
+    "  -L --losses                show the time ranges where packets were "
+    "lost while collecting instead of entries\n"
+    "  -n --top=<n>               only show the <n> largest groups\n"
+    "  -U --uid=<uid>             only show entries of this user\n"
+    "  -S --sport=<port>[-<port>] only show entries from these source ports\n"
+    "  -D --dport=<port>[-<port>] only show entries to these destination "
+    "ports\n"
+    "  -a --daddr=<addr>[/<len>]  only show entries to this destination "
+    "address or network, IPv4 or IPv6\n"
+    "  -p --protocol=<proto>      only show entries of this protocol (tcp, "
+    "udp or a number)\n"
     "\n";
 
 void sig_handler(int signo) {
@@ -70,59 +92,101 @@ void sig_handler(int signo) {
         puts("Terminated due to SIGHUP ...");
 }
 
-static void callback(const State *s, const Timerange *range) {
-    int nr_entries = s->header->nr_entries;
+// Entries are counted in there instead of being printed if grouping
+static Aggregate aggregate;
+static Writer writer;
+static enum OutputFormat output_format = OUTPUT_TEXT;
 
-    DEBUG("callback: extracting %d entries", nr_entries);
+static void callback_aggregate(const State *s, const uint32_t *sel,
+                               uint32_t nr_sel) {
+    aggregate_entries(&aggregate, s, sel, nr_sel);
+}
 
-    int i = 0;
-    while (i < nr_entries && s->store[i].timestamp < range->from)
-        i++;
+static void print_groups(uint64_t top) {
+    AggregateGroup *groups = aggregate_sort(&aggregate);
+    uint64_t n = aggregate.nr_groups;
 
-    time_t last_t = 0;
-    char timestamp[20];
-    while (i < nr_entries && s->store[i].timestamp < range->until) {
-        if (last_t != s->store[i].timestamp || !last_t) {
-            last_t = s->store[i].timestamp;
-            strftime(timestamp, 20, DATE_FORMAT_OUTPUT, localtime(&last_t));
-        }
+    if (top && top < n)
+        n = top;
+    output_groups(&writer, output_format, aggregate.fields, groups, n);
+}
 
-        printf("  "
-               "%-18s:\t"
-               "daddr=%-16s\t"
-               "proto=%s\t"
-               "uid=%d\t"
-               "sport=%d\t"
-               "dport=%d\n",
-               timestamp, inet_ntoa(s->store[i].daddr),
-               s->store[i].protocol == IPPROTO_TCP ? "TCP" : "UDP",
-               s->store[i].uid, s->store[i].sport, s->store[i].dport);
-        ++i;
+static void callback(const State *s, const uint32_t *sel, uint32_t nr_sel) {
+    DEBUG("callback: extracting %u/%u entries", nr_sel,
+          s->header->nr_entries);
+    output_entries(&writer, output_format, s, sel, nr_sel);
+}
+
+// Entries may be missing from the output if packets were lost while
+// collecting, which is told on stderr so as not to mix with the output
+static void report_losses(sqlite3 *db, const Timerange *range) {
+    Header *headers;
+    uint32_t n = db_read_losses(db, range, &headers);
+    uint64_t nr_lost = 0, nr_overflows = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        nr_lost += headers[i].nr_lost;
+        nr_overflows += headers[i].nr_overflows;
     }
+    if (n)
+        fprintf(stderr,
+                PROG ": %lu packets lost (%lu receive buffer overflows) in "
+                     "%u trunks of this time range, see --losses\n",
+                nr_lost, nr_overflows, n);
+    free(headers);
+}
+
+static void extract_all(const char *storage, const Timerange *range,
+                        const Filter *filter, StateCallback cb,
+                        uint32_t nr_jobs) {
+    sqlite3 *db = NULL;
+    db_open_reader(&db, storage);
+    db_read_data_by_timerange(db, range, filter, cb, nr_jobs);
+    report_losses(db, range);
+    db_close(db);
 }
 
-static void extract_all(const char *storage, const Timerange *range) {
+static void list_losses(const char *storage, const Timerange *range) {
     sqlite3 *db = NULL;
-    db_open(&db, storage);
-    db_read_data_by_timerange(db, range, callback);
+    Header *headers;
+    db_open_reader(&db, storage);
+    uint32_t n = db_read_losses(db, range, &headers);
+    output_losses(&writer, output_format, headers, n);
+    free(headers);
     db_close(db);
 }
 
-static time_t parse_date_string(time_t default_t, const char *date) {
+// Return the date in milliseconds since UNIX epoch
+static int64_t parse_date_string(int64_t default_t, const char *date) {
     struct tm parsed;
     char *ret;
     if (!date)
         return default_t;
 
+    // Let mktime find out whether daylight saving time is in effect
 #define PARSE(FORMAT)                                                          \
+    memset(&parsed, 0, sizeof(parsed));                                        \
+    parsed.tm_isdst = -1;                                                      \
     ret = strptime(date, FORMAT, &parsed);                                     \
     if (ret && !*ret)                                                          \
-        return mktime(&parsed);
+        return (int64_t)mktime(&parsed) * 1000;
 
     PARSE(DATE_FORMAT);
     PARSE(DATE_FORMAT_FULL);
     PARSE(DATE_FORMAT_FULL2);
 
+    // Seconds may be followed by a fraction, down to milliseconds
+    if (ret && *ret == '.' && ret[1]) {
+        int64_t msec = 0;
+        int digits = 0;
+        for (++ret; *ret >= '0' && *ret <= '9'; ++ret, ++digits)
+            if (digits < 3)
+                msec = msec * 10 + (*ret - '0');
+        for (; digits < 3; ++digits)
+            msec *= 10;
+        if (!*ret)
+            return (int64_t)mktime(&parsed) * 1000 + msec;
+    }
+
     FATAL("Wrong date format: expected: \"" DATE_FORMAT_HUMAN "\", got: \"%s\"",
           date);
     return -1;
@@ -131,23 +195,40 @@ static time_t parse_date_string(time_t default_t, const char *date) {
 static void populate_date_range(Timerange *range, const char *since,
                                 const char *until) {
     range->from = parse_date_string(0, since);
-    range->until = parse_date_string(time(NULL), until);
+    range->until = parse_date_string((int64_t)time(NULL) * 1000, until);
 }
 
 int main(int argc, char *argv[]) {
     char *storage = NULL;
     char *date_since_str = NULL, *date_until_str = NULL;
     Timerange date_range;
+    uint32_t nr_jobs = 1;
+    Filter filter = {0};
+    uint32_t group_by = 0, bucket = 60;
+    uint64_t top = 0;
+    bool losses = false;
 
     struct option longopts[] = {{"storage_file", required_argument, NULL, 'd'},
                                 {"since", optional_argument, NULL, 's'},
                                 {"until", optional_argument, NULL, 'u'},
+                                {"jobs", required_argument, NULL, 'j'},
+                                {"format", required_argument, NULL, 'o'},
+                                {"group_by", required_argument, NULL, 'G'},
+                                {"bucket", required_argument, NULL, 'b'},
+                                {"top", required_argument, NULL, 'n'},
+                                {"losses", no_argument, NULL, 'L'},
+                                {"uid", required_argument, NULL, 'U'},
+                                {"sport", required_argument, NULL, 'S'},
+                                {"dport", required_argument, NULL, 'D'},
+                                {"daddr", required_argument, NULL, 'a'},
+                                {"protocol", required_argument, NULL, 'p'},
                                 {"help", no_argument, NULL, 'h'},
                                 {"version", no_argument, NULL, 'v'},
                                 {0, 0, 0, 0}};
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "d:s:u:hv", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "a:b:d:D:G:j:Ln:o:p:s:S:u:U:hv",
+                              longopts, NULL)) != -1) {
         switch (opt) {
         case 'h':
             printf("%s", help_text);
@@ -162,6 +243,41 @@ int main(int argc, char *argv[]) {
                 FATAL("Expected: --storage_file=[PATH]");
             storage = strdup(optarg);
             break;
+        case 'j':
+            nr_jobs = atoi(optarg);
+            break;
+        case 'o':
+            output_format = output_parse_format(optarg);
+            break;
+        case 'G':
+            group_by = aggregate_parse_fields(optarg);
+            ASSERT(group_by != 0, "Group by one or more of time, uid, daddr, "
+                                  "dport and proto (see --help)\n");
+            break;
+        case 'b':
+            bucket = atoi(optarg);
+            break;
+        case 'n':
+            top = strtoull(optarg, NULL, 10);
+            break;
+        case 'L':
+            losses = true;
+            break;
+        case 'U':
+            filter_parse_uid(&filter, optarg);
+            break;
+        case 'S':
+            filter_parse_port(&filter, FILTER_SPORT, optarg);
+            break;
+        case 'D':
+            filter_parse_port(&filter, FILTER_DPORT, optarg);
+            break;
+        case 'a':
+            filter_parse_daddr(&filter, optarg);
+            break;
+        case 'p':
+            filter_parse_protocol(&filter, optarg);
+            break;
         case 's':
             if (!optarg)
                 FATAL("Expected: --since=\"" DATE_FORMAT_HUMAN "\"");
@@ -180,6 +296,13 @@ int main(int argc, char *argv[]) {
     // verify arguments
     ASSERT(storage != NULL,
            "You must provide a storage directory (see --help)");
+    ASSERT(nr_jobs > 0, "Number of jobs must be at least 1 (see --help)\n");
+    ASSERT(!group_by || output_format != OUTPUT_BINARY,
+           "Groups can't be written in binary format (see --help)\n");
+    ASSERT(!losses || output_format != OUTPUT_BINARY,
+           "Losses can't be written in binary format (see --help)\n");
+    ASSERT(bucket > 0,
+           "Time buckets must be at least 1 second (see --help)\n");
 
     if (check_file_exist(storage) < 0)
         ERROR("storage file not exist");
@@ -191,7 +314,20 @@ int main(int argc, char *argv[]) {
     free(date_since_str);
     free(date_until_str);
 
-    extract_all(storage, &date_range);
+    writer_init(&writer, STDOUT_FILENO, OUTPUT_BUFFER_SIZE);
+    if (losses) {
+        list_losses(storage, &date_range);
+    } else if (group_by) {
+        aggregate_init(&aggregate, group_by, bucket);
+        extract_all(storage, &date_range, &filter, callback_aggregate,
+                    nr_jobs);
+        print_groups(top);
+        aggregate_destroy(&aggregate);
+    } else {
+        output_begin(&writer, output_format);
+        extract_all(storage, &date_range, &filter, callback, nr_jobs);
+    }
+    writer_destroy(&writer);
     free(storage);
 
     return 0;
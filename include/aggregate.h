@@ -0,0 +1,49 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include "main.h"
+
+// Fields entries can be grouped by
+enum AggregateField {
+    AGGREGATE_TIME = 1 << 0,
+    AGGREGATE_UID = 1 << 1,
+    AGGREGATE_DADDR = 1 << 2,
+    AGGREGATE_DPORT = 1 << 3,
+    AGGREGATE_PROTOCOL = 1 << 4,
+};
+
+// Fields not grouped by are left zero.  IPv4 addresses are IPv4-mapped
+// so that both IP versions are grouped alike, the IP version telling
+// them apart from IPv6 entries to IPv4-mapped addresses.
+typedef struct _AggregateKey {
+    time_t time;
+    uint32_t uid;
+    struct in6_addr daddr;
+    uint16_t dport;
+    uint8_t protocol;
+    uint8_t ip_version;
+} AggregateKey;
+
+typedef struct _AggregateGroup {
+    AggregateKey key;
+    uint64_t count;
+} AggregateGroup;
+
+// Number of entries per group, in an open addressing hash table
+typedef struct _Aggregate {
+    // Set of enum AggregateField
+    uint32_t fields;
+    // Width of time buckets in seconds
+    uint32_t bucket;
+    AggregateGroup *groups;
+    uint64_t capacity, nr_groups;
+} Aggregate;
+
+void aggregate_init(Aggregate *a, uint32_t fields, uint32_t bucket);
+void aggregate_destroy(Aggregate *a);
+uint32_t aggregate_parse_fields(const char *flag);
+void aggregate_entries(Aggregate *a, const State *s, const uint32_t *sel,
+                       uint32_t nr_sel);
+AggregateGroup *aggregate_sort(Aggregate *a);
+
+#endif // AGGREGATE_H
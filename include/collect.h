@@ -3,10 +3,15 @@
 #define _COLLECT_H
 
 #include "main.h"
-void collect_open_netlink(Netlink *nl, uint16_t group_id);
+void collect_open_netlink(Netlink *nl, uint16_t group_id,
+                          uint32_t rcvbuf_size);
 void collect_close_netlink(Netlink *nl);
+int collect_packet(State *s, NflogPacket *p);
+void collect_begin(State *s);
+void collect_end(State *s);
 void *collect_worker(void *targs);
-void state_init(State **s, Netlink *nl, Global *g);
+void state_init(State **s, Netlink *nl, Global *g, const char *staging);
+void state_reset(State *s);
 void state_free(State *s);
 
 #endif // _COLLECT_H
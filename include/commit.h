@@ -1,6 +1,51 @@
 #ifndef COMMIT_H
 #define COMMIT_H
 
-void *commit(void *targs);
+#include "main.h"
+#include "sql.h"
+#include <zstd.h>
+
+// State of the commit worker, reused from one trunk to the next: the
+// database connection, compression context, dictionary and buffers
+typedef struct _Committer {
+    Global *g;
+    DBWriter w;
+    ZSTD_CCtx *cctx;
+    void *lz4_state;
+
+    // One encoding and one compression buffer per trunk of a batch, and
+    // the size of the trunk encoded
+    void **encoded, **compressed;
+    uint32_t *encoded_sizes;
+    size_t encoded_cap, compressed_cap;
+
+    // Dictionary in use (dict_id 0 if none), digested once for each
+    // compression level it is used at, along with samples of recent
+    // trunks to train the next one on
+    void *dict;
+    size_t dict_size;
+    ZSTD_CDict **cdicts;
+    uint32_t dict_id;
+    // Dictionary trained during the current batch, not in use until the
+    // transaction storing it (next_dict_id once stored) is committed
+    void *next_dict;
+    size_t next_dict_size;
+    uint32_t next_dict_id;
+    uint8_t *samples;
+    size_t sample_sizes[g_zstd_dict_nr_samples];
+    uint64_t nr_samples;
+    uint32_t nr_trunks_since_train;
+
+    // Compression level of the trunks being committed
+    int level;
+} Committer;
+
+void committer_init(Committer *c, Global *g);
+void committer_destroy(Committer *c);
+void *compress_trunk(Committer *c, State *s, uint32_t i);
+void committer_store_dict(Committer *c);
+void committer_use_dict(Committer *c);
+int compression_level(Global *g, uint32_t nr_pending);
+void *commit_worker(void *targs);
 
 #endif // COMMIT_H
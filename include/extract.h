@@ -1,7 +1,79 @@
 #ifndef _EXTRACT_H
 #define _EXTRACT_H
 
+#include "filter.h"
 #include "main.h"
-bool extract(State *s, const void *src);
+#include <zstd.h>
+
+// Decompression state shared by the trunks of one extraction: the
+// zstd context, the dictionaries indexed by id and a scratch buffer
+typedef struct _ExtractContext {
+    ZSTD_DCtx *dctx;
+    ZSTD_DDict **ddicts;
+    uint32_t nr_ddicts;
+    // Dictionaries borrowed from another context, see extract_pool_init
+    bool shared_ddicts;
+    void *buf;
+    size_t buf_size;
+    // Pool the context belongs to, if any
+    struct _ExtractPool *pool;
+} ExtractContext;
+
+// A trunk read from the database, waiting to be extracted.  Jobs are
+// slots of the pool, their state and buffers are reused from one trunk
+// to the next.
+typedef struct _ExtractJob {
+    State s;
+    Header header;
+    void *src;
+    size_t src_cap;
+    Entry *store;
+    uint32_t store_cap;
+    // Indices of the entries matching the filter
+    uint32_t *sel;
+    uint32_t sel_cap, nr_sel;
+    bool ok, done;
+} ExtractJob;
+
+// Trunks are extracted and filtered by a pool of workers, at most
+// `window` of them in flight, and handed back in the order they were
+// submitted
+typedef struct _ExtractPool {
+    const Timerange *range;
+    const Filter *filter;
+
+    // No worker if trunks are extracted as they are submitted, with
+    // the single context
+    pthread_t *workers;
+    ExtractContext *ctxs;
+    uint32_t nr_workers;
+
+    ExtractJob *jobs;
+    uint32_t window;
+    // Trunks submitted, taken by a worker and handed back so far
+    uint64_t submitted, claimed, emitted;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready, job_done;
+} ExtractPool;
+
+void extract_init(ExtractContext *ctx);
+void extract_add_dict(ExtractContext *ctx, uint32_t id, const void *dict,
+                      size_t size);
+void extract_destroy(ExtractContext *ctx);
+bool extract(ExtractContext *ctx, State *s, const void *src);
+
+void extract_pool_init(ExtractPool *p, uint32_t nr_workers,
+                       const ExtractContext *dicts, const Timerange *range,
+                       const Filter *filter);
+void extract_pool_destroy(ExtractPool *p);
+bool extract_pool_full(ExtractPool *p);
+bool extract_pool_empty(ExtractPool *p);
+ExtractJob *extract_pool_reserve(ExtractPool *p);
+void *extract_job_buffer(ExtractJob *job, size_t size);
+void extract_pool_submit(ExtractPool *p);
+ExtractJob *extract_pool_next(ExtractPool *p);
+uint32_t entry_lower_bound(const Entry *store, uint32_t nr_entries,
+                           int64_t t);
 
 #endif // _EXTRACT_H
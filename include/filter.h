@@ -0,0 +1,37 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "main.h"
+
+// Predicates on the fields of an entry, all of which must hold
+enum FilterField {
+    FILTER_UID = 1 << 0,
+    FILTER_SPORT = 1 << 1,
+    FILTER_DPORT = 1 << 2,
+    FILTER_DADDR = 1 << 3,
+    FILTER_PROTOCOL = 1 << 4,
+};
+
+typedef struct _Filter {
+    // Set of enum FilterField in use
+    uint32_t fields;
+    uint32_t uid;
+    // Inclusive port ranges
+    uint16_t sport_min, sport_max;
+    uint16_t dport_min, dport_max;
+    // Destination network and mask, in network byte order, of either
+    // IP version
+    uint8_t daddr_version;
+    uint32_t daddr, daddr_mask;
+    struct in6_addr daddr6, daddr6_mask;
+    uint8_t protocol;
+} Filter;
+
+void filter_parse_uid(Filter *f, const char *flag);
+void filter_parse_port(Filter *f, enum FilterField field, const char *flag);
+void filter_parse_daddr(Filter *f, const char *flag);
+void filter_parse_protocol(Filter *f, const char *flag);
+uint32_t filter_entries(const Filter *f, const State *s, uint32_t begin,
+                        uint32_t end, uint32_t *sel);
+
+#endif // FILTER_H
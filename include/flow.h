@@ -0,0 +1,12 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "main.h"
+
+void flow_table_init(FlowTable *ft, uint32_t nr_slots);
+void flow_table_destroy(FlowTable *ft);
+void flow_table_clear(FlowTable *ft);
+uint32_t flow_table_lookup(FlowTable *ft, const Entry *e, int64_t t,
+                           uint32_t window, uint32_t index);
+
+#endif // FLOW_H
@@ -0,0 +1,10 @@
+#ifndef GC_H
+#define GC_H
+
+#include "main.h"
+
+void *gc_worker(void *targs);
+void gc_account(Global *g, int64_t size);
+void gc_vacuum(const char *storage, uint32_t time_limit);
+
+#endif // GC_H
@@ -0,0 +1,13 @@
+#ifndef INET6_H
+#define INET6_H
+
+#include "main.h"
+
+void inet6_table_init(Inet6Table *t, struct in6_addr *addrs,
+                      uint32_t capacity, bool indexed);
+void inet6_table_destroy(Inet6Table *t);
+void inet6_table_clear(Inet6Table *t);
+void inet6_table_reserve(Inet6Table *t, uint32_t capacity);
+uint32_t inet6_table_add(Inet6Table *t, const struct in6_addr *addr);
+
+#endif // INET6_H
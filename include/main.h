@@ -28,25 +28,88 @@
 #include <linux/tcp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 
 // Global variables
 #define g_sqlite_table_header "nfcollect_v1_header"
 #define g_sqlite_table_data "nfcollect_v1_data"
+#define g_sqlite_index_time "nfcollect_v1_header_time"
+#define g_sqlite_index_span "nfcollect_v1_header_span"
+#define g_sqlite_index_data "nfcollect_v1_header_data"
+#define g_sqlite_table_dict "nfcollect_v1_dict"
 #define g_sqlite_nr_fail_retry 8
-// Number of blocks recycled at each GC when space is depleted
+// Milliseconds to wait for a lock held by another connection
+#define g_sqlite_busy_timeout 10000
+// Size of the database mapped in memory when extracting trunks
+#define g_sqlite_mmap_size (1024LL * 1024 * 1024)
+// Number of blocks recycled in each GC transaction when space is depleted
 #define g_gc_rate 16
+// Once over budget, GC frees space until this fraction of budget is used
 #define g_gc_cap 0.85
+// Time budget (ms) of one GC round, after which inserts get the database
+#define g_gc_time_budget 100
+// Seconds between two GC checks when not woken up by the commit worker
+#define g_gc_interval 10
+// Number of pages handed back to the OS by each incremental vacuum step
+#define g_gc_vacuum_pages 256
+// Approximate size of the header row of a trunk, mostly its synopsis,
+// accounted against the storage budget along with its data
+#define g_header_row_size (sizeof(Synopsis) + 64)
 // Default number of packets stored in a block
 #define g_max_nr_entries_default (256 * 1024 / 24)
+// Default number of preallocated trunks per NFLOG group: one being filled,
+// one being committed and one spare
+#define g_nr_trunks_per_group_default 3
+// Default maximum number of trunks committed in one transaction
+#define g_commit_batch_default 8
+// Size of trained zstd dictionaries, the number of trunks they are trained
+// on and the number of trunks after which a new one is trained
+#define g_zstd_dict_size (64 * 1024)
+#define g_zstd_dict_nr_samples 16
+#define g_zstd_dict_retrain 4096
+// Range of zstd levels picked by the adaptive compression level: the
+// highest one while the commit worker keeps up, down to the fastest
+// one when every spare trunk is waiting to be committed
+#define g_zstd_level_adaptive_max 19
+#define g_zstd_level_adaptive_min -5
+// Trunks smaller than this are not worth splitting among zstd workers
+#define g_zstd_mt_min_size (1024 * 1024)
+// Size in bytes of the bloom filter of a trunk synopsis, and the number
+// of bits set for each value
+#define g_synopsis_bloom_size 1024
+#define g_synopsis_bloom_hashes 3
+// Number of slots of the flow table of each NFLOG group, a power of two,
+// and the number of slots probed for a flow before evicting the oldest
+#define g_flow_table_size 4096
+#define g_flow_table_probes 8
+// Default time (ms) during which further packets of a flow are counted
+// in its entry instead of being stored
+#define g_flow_window_default 4000
+// Default size (KiB) of the netlink socket receive buffer of each NFLOG
+// group, absorbing bursts while the receive worker is busy
+#define g_rcvbuf_size_default 4096
+// Default time (s) after which a trunk is committed even if not full,
+// so that entries of quiet hosts show up in nfextract in time
+#define g_max_trunk_age_default 300
+// Longest time (ms) a receive worker waits for packets before checking
+// whether its trunk is due or nfcollect is shutting down
+#define g_collect_poll_interval 1000
+// Number of buckets of the latency histograms: bucket i counts the
+// operations that took at most 2^i µs, the last one the slower ones
+#define g_stats_nr_buckets 24
+// Default time (s) between two rewrites of the statistics file
+#define g_stats_interval_default 10
 #ifdef DEBUG_OUTPUT
 #define DEBUG_ON 1
 #else
@@ -92,65 +155,302 @@
 #define UNUSED_FUNCTION(x) UNUSED_##x
 #endif
 
-enum CompressionType { COMPRESS_NONE, COMPRESS_LZ4, COMPRESS_ZSTD };
+// Stored in the trunk header, new values must be appended
+enum CompressionType {
+    COMPRESS_NONE,
+    COMPRESS_LZ4,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4HC
+};
+
+// On-disk layout of a trunk, before compression:
+//   TRUNK_FORMAT_ROW: array of Entry, as written by nfcollect <= 0.2
+//   TRUNK_FORMAT_COLUMNAR: one array per field, see lib/trunk.c
+//   TRUNK_FORMAT_COLUMNAR_MSEC: same, with millisecond timestamps
+//   TRUNK_FORMAT_COLUMNAR_COUNT: same, with packet counts
+//   TRUNK_FORMAT_COLUMNAR_INET6: same, with IPv6 entries
+enum TrunkFormat {
+    TRUNK_FORMAT_ROW,
+    TRUNK_FORMAT_COLUMNAR,
+    TRUNK_FORMAT_COLUMNAR_MSEC,
+    TRUNK_FORMAT_COLUMNAR_COUNT,
+    TRUNK_FORMAT_COLUMNAR_INET6
+};
+
+// Size of the entries of TRUNK_FORMAT_ROW trunks, which are the first
+// bytes of an Entry
+#define g_row_entry_size 24
+
+// Summary of the entries of a trunk, stored along with its header so
+// that trunks can be skipped without reading them, see lib/synopsis.c
+typedef struct __attribute__((packed)) _Synopsis {
+    // Destination addresses in host byte order
+    uint32_t daddr_min, daddr_max;
+    uint16_t sport_min, sport_max;
+    uint16_t dport_min, dport_max;
+    // Bloom filter of the uids, destination ports, destination
+    // addresses and protocols
+    uint8_t bloom[g_synopsis_bloom_size];
+} Synopsis;
 
 typedef struct _Header {
     uint32_t nr_entries;
     uint32_t raw_size;
     enum CompressionType compression_type;
+    enum TrunkFormat format;
+    // zstd dictionary the trunk is compressed with, 0 if none
+    uint32_t dict_id;
+    // Compression level the trunk is compressed at, 0 if not applicable
+    int compression_level;
     time_t start_time;
     time_t end_time;
+    // Packets logged by the kernel while the trunk was being filled but
+    // missing from it, and the number of times the netlink socket
+    // overflowed meanwhile.  Both are 0 in trunks written by older
+    // versions, which didn't keep track.
+    uint32_t nr_lost;
+    uint32_t nr_overflows;
+    // Trunks written by older versions have no synopsis
+    bool has_synopsis;
+    Synopsis synopsis;
 } Header;
 
 typedef struct __attribute__((packed)) _Entry {
     // current timestamp since UNIX epoch
     time_t timestamp;
-    // dest address
+    // dest address, or for IPv6 entries the index of their address in
+    // the IPv6 address table of the trunk
     struct in_addr daddr;
     // uid
     uint32_t uid;
-    // unused space, just for padding
-    uint8_t __unused1;
+    // 4 or 6, the padding of trunks written by nfcollect <= 0.2
+    uint8_t ip_version;
     // IP protocol (UDP or TCP)
     uint8_t protocol;
-    // unused space, just for padding
-    uint16_t __unused2;
+    // milliseconds within timestamp, always 0 in trunks written by
+    // nfcollect <= 0.2 where this was padding
+    uint16_t msec;
     // source port
     uint16_t sport;
     // destination port
     uint16_t dport;
+    // number of packets of the flow the entry stands for, see lib/flow.c
+    uint32_t count;
+    // unused space, just for padding
+    uint32_t __unused3;
 
-    /* size: 24, cachelines: 1, members: 8 */
+    /* size: 32, cachelines: 1, members: 10 */
 } Entry;
 
+// Milliseconds since UNIX epoch of an entry
+#define ENTRY_TIME_MSEC(e) ((int64_t)(e)->timestamp * 1000 + (e)->msec)
+
+// Distinct IPv6 destination addresses of a trunk, see lib/inet6.c
+typedef struct _Inet6Table {
+    struct in6_addr *addrs;
+    uint32_t size, capacity;
+    // Open addressing index of the addresses (index + 1 of each slot, 0
+    // if the slot is empty), only kept while collecting
+    uint32_t *slots;
+    uint32_t mask;
+    // addrs is not ours to free, see lib/staging.c
+    bool borrowed;
+} Inet6Table;
+
+// One flow of the flow table and the entry it was last stored in
+typedef struct _FlowSlot {
+    uint32_t daddr, uid;
+    uint16_t sport, dport;
+    uint8_t protocol, ip_version;
+    // Index of the entry in the trunk being filled
+    uint32_t index;
+    // Time (ms since UNIX epoch) of the first packet of the entry,
+    // 0 if the slot is free
+    int64_t start;
+} FlowSlot;
+
+// Open addressing hash table of recently stored flows, see lib/flow.c
+typedef struct _FlowTable {
+    FlowSlot *slots;
+    uint32_t mask;
+} FlowTable;
+
+// Counters of an NFLOG group since nfcollect started, only written by
+// the receive worker of the group, see lib/stats.c
+typedef struct _CollectStats {
+    uint64_t nr_recvs;
+    uint64_t nr_recv_bytes;
+    // Packets handed to handle_packet, which either stores them as a new
+    // entry, counts them in the entry of their flow (rate-limited) or
+    // drops them for one of the other reasons
+    uint64_t nr_packets;
+    uint64_t nr_stored;
+    uint64_t nr_rate_limited;
+    uint64_t nr_not_ip;
+    uint64_t nr_not_tcp_udp;
+    uint64_t nr_ack_only;
+    uint64_t nr_truncated;
+    uint64_t nr_no_uid;
+    uint64_t nr_trunk_full;
+    // Sums of nr_lost (which includes nr_trunk_full) and nr_overflows
+    // of the trunks filled
+    uint64_t nr_lost;
+    uint64_t nr_overflows;
+} CollectStats;
+
+typedef struct _LatencyHistogram {
+    uint64_t buckets[g_stats_nr_buckets];
+    uint64_t count;
+    uint64_t sum_usec;
+} LatencyHistogram;
+
+// Counters of the commit and GC workers, each written by its worker only
+typedef struct _Stats {
+    uint64_t nr_trunks_committed;
+    uint64_t nr_entries_committed;
+    // Size of the committed trunks in memory, once encoded in columns,
+    // and once compressed
+    uint64_t raw_bytes;
+    uint64_t encoded_bytes;
+    uint64_t compressed_bytes;
+    // Time spent compressing each trunk, and inserting each batch
+    LatencyHistogram compress_latency;
+    LatencyHistogram insert_latency;
+    // Time from a trunk being queued by its receive worker until it is
+    // committed
+    LatencyHistogram commit_latency;
+    // GC rounds, the trunks they recycled and the time they took
+    uint64_t nr_gc_rounds;
+    uint64_t nr_gc_trunks;
+    uint64_t gc_usec;
+} Stats;
+
+// What handle_packet needs of an NFLOG message, see collect_packet.
+// Seq, timestamp and uid are fetched from `nfa` by collect_packet, only
+// for the packets that need them, unless `nfa` is NULL and they are
+// given (see bench_ingest).  Each is only set if the kernel provided it.
+typedef struct _NflogPacket {
+    char *payload;
+    int payload_len;
+    struct nflog_data *nfa;
+    bool has_seq, has_timestamp, has_uid;
+    uint32_t seq;
+    uint32_t uid;
+    struct timeval timestamp;
+} NflogPacket;
+
 typedef struct _nfl_nl_t {
     struct nflog_handle *fd;
     struct nflog_g_handle *group_fd;
+    uint16_t group_id;
+
+    // Recent flows of this group, for rate-limiting purpose
+    FlowTable flows;
+    // Time (ms since UNIX epoch) of the previous entry of this group,
+    // entry times never go backwards past it
+    int64_t prev_entry_time;
+    // Sequence number the kernel should give to the next packet of this
+    // group, gaps are packets lost on the way
+    bool has_seq;
+    uint32_t next_seq;
+    CollectStats stats;
 } Netlink;
 
+// Bounded FIFO of trunks, used both as the pool of free trunks and
+// as the queue of full trunks waiting to be committed
+typedef struct _TrunkQueue {
+    struct _State **trunks;
+    uint32_t capacity;
+    uint32_t head, size;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    // Once closed, popping an empty queue returns NULL at once
+    bool closed;
+} TrunkQueue;
+
 typedef struct _Global {
-    uint16_t nl_group_id;
+    uint16_t *nl_group_ids;
+    uint16_t nr_nl_groups;
 
     int64_t storage_budget;
     int64_t storage_consumed;
     pthread_mutex_t storage_consumed_lock;
+    // Signaled when storage_consumed exceeds storage_budget
+    pthread_cond_t gc_cond;
 
     uint32_t max_nr_entries;
     const char *storage_file;
     enum CompressionType compression_type;
+
+    // Trunks are preallocated once and rotate between the
+    // receive workers and the commit worker
+    uint32_t nr_trunks;
+    struct _State **trunks;
+    TrunkQueue free_trunks;
+    TrunkQueue commit_queue;
+    // Number of times a receive worker found the pool depleted
+    // and had to wait for the commit worker
+    uint64_t nr_pool_stalls;
+
+    // Group commit: up to commit_batch trunks are committed in one
+    // transaction, waiting at most commit_delay ms for them to arrive
+    uint32_t commit_batch;
+    uint32_t commit_delay;
+
+    // Compress trunks with a zstd dictionary trained on recent trunks
+    bool zstd_dict;
+    // Compression level, 0 for the default of the algorithm.  With
+    // adaptive_level, the zstd level follows the commit backlog instead.
+    int compression_level;
+    bool adaptive_level;
+    // Number of zstd worker threads for large trunks, 0 to disable
+    uint32_t compression_workers;
+
+    // Further packets of a flow within this many ms of its entry are
+    // counted in the entry, 0 to store every packet
+    uint32_t flow_window;
+    // Netlink socket receive buffer size in KiB, 0 for the system default
+    uint32_t rcvbuf_size;
+    // Trunks are committed at the latest this many seconds after they
+    // started, 0 to only commit full trunks
+    uint32_t max_trunk_age;
+    // Set by signal handlers: receive workers commit their trunk and
+    // return
+    volatile sig_atomic_t stop;
+    // Keep the trunks in staging files next to the storage, so that a
+    // crash doesn't lose them, see lib/staging.c
+    bool staging;
+
+    // Statistics are written to stats_file every stats_interval seconds
+    // if set, see lib/stats.c
+    const char *stats_file;
+    uint32_t stats_interval;
+    Stats stats;
+    // The nr_nl_groups groups being received
+    Netlink *netlinks;
 } Global;
 
 typedef struct _State {
     Header *header;
     Entry *store;
+    Inet6Table daddrs6;
     Netlink *netlink_fd;
     Global *global;
+    // Mapping of the staging file holding the trunk, if any
+    void *staging;
+    size_t staging_size;
+    // When the trunk was queued for commit (µs, see stats_now_usec)
+    uint64_t queued_usec;
 } State;
 
+// Entries from `from` (inclusive) until `until` (exclusive), in
+// milliseconds since UNIX epoch
 typedef struct _Timerange {
-    time_t from, until;
+    int64_t from, until;
 } Timerange;
 
-typedef void (*StateCallback)(const State *s, const Timerange *t);
+// Called with the indices of the entries of a trunk that matched
+typedef void (*StateCallback)(const State *s, const uint32_t *sel,
+                              uint32_t nr_sel);
 
 #endif // _MAIN_H
@@ -0,0 +1,71 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "aggregate.h"
+#include "main.h"
+
+#define OUTPUT_DATE_FORMAT "%Y-%m-%d %H:%M:%S"
+// Size of the output buffer of nfextract
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+enum OutputFormat { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_JSON, OUTPUT_BINARY };
+
+// Header of the binary entry stream, followed by one OutputRecord per
+// entry.  All integers are little-endian.
+#define OUTPUT_BINARY_MAGIC "NFCE"
+#define OUTPUT_BINARY_VERSION 3
+typedef struct __attribute__((packed)) _OutputHeader {
+    char magic[4];
+    uint16_t version;
+    // Size of a record, so that fields can be appended
+    uint16_t record_size;
+} OutputHeader;
+
+typedef struct __attribute__((packed)) _OutputRecord {
+    // Seconds since UNIX epoch
+    int64_t timestamp;
+    // Destination IPv4 address in network byte order, zero for IPv6
+    uint8_t daddr[4];
+    uint32_t uid;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t protocol;
+    // 4 or 6 since version 3, padding before
+    uint8_t ip_version;
+    // Milliseconds within timestamp, padding in version 1
+    uint16_t msec;
+    // Number of packets the entry stands for, since version 2
+    uint32_t count;
+    // Destination IPv6 address, zero for IPv4, since version 3
+    uint8_t daddr6[16];
+} OutputRecord;
+
+// Output is gathered in a large buffer written to the file descriptor
+// once full, bypassing stdio
+typedef struct _Writer {
+    int fd;
+    char *buf;
+    size_t size, capacity;
+
+    // Local time of the minute starting at `minute`, see format_timestamp
+    bool minute_set;
+    time_t minute;
+    char timestamp[20];
+} Writer;
+
+void writer_init(Writer *w, int fd, size_t capacity);
+void writer_flush(Writer *w);
+void writer_destroy(Writer *w);
+char *writer_reserve(Writer *w, size_t size);
+void writer_write(Writer *w, const void *data, size_t size);
+
+enum OutputFormat output_parse_format(const char *flag);
+void output_begin(Writer *w, enum OutputFormat format);
+void output_entries(Writer *w, enum OutputFormat format, const State *s,
+                    const uint32_t *sel, uint32_t nr_sel);
+void output_groups(Writer *w, enum OutputFormat format, uint32_t fields,
+                   const AggregateGroup *groups, uint64_t nr_groups);
+void output_losses(Writer *w, enum OutputFormat format, const Header *headers,
+                   uint32_t nr_headers);
+
+#endif // OUTPUT_H
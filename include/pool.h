@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "main.h"
+
+void trunk_queue_init(TrunkQueue *q, uint32_t capacity);
+void trunk_queue_destroy(TrunkQueue *q);
+void trunk_queue_push(TrunkQueue *q, State *s);
+void trunk_queue_close(TrunkQueue *q);
+State *trunk_queue_pop(TrunkQueue *q);
+State *trunk_queue_timed_pop(TrunkQueue *q,
+                             const struct timespec *deadline);
+State *trunk_queue_try_pop(TrunkQueue *q);
+uint32_t trunk_queue_size(TrunkQueue *q);
+
+void trunk_pool_init(Global *g);
+void trunk_pool_destroy(Global *g);
+State *trunk_pool_get(Global *g);
+void trunk_pool_put(State *s);
+
+#endif // POOL_H
@@ -1,18 +1,47 @@
 #ifndef SQL_H
 #define SQL_H
 
+#include "extract.h"
 #include "main.h"
 #include <sqlite3.h>
 
+// A long-lived connection used by the commit worker, along with
+// statements prepared once and reused by every commit
+typedef struct _DBWriter {
+    sqlite3 *db;
+    sqlite3_stmt *insert_data;
+    sqlite3_stmt *insert_header;
+    sqlite3_stmt *select_oldest;
+    sqlite3_stmt *delete_header;
+    sqlite3_stmt *delete_data;
+    sqlite3_stmt *insert_dict;
+} DBWriter;
+
 int db_set_pragma(sqlite3 *db);
 int db_vacuum(sqlite3 *db);
+int db_set_incremental_vacuum(sqlite3 *db);
+int db_set_mmap_size(sqlite3 *db, int64_t size);
+int db_incremental_vacuum(sqlite3 *db, uint32_t nr_pages);
+bool db_is_incremental_vacuum(sqlite3 *db);
+int64_t db_get_freelist_size(sqlite3 *db);
 int db_create_table(sqlite3 *db);
 int db_open(sqlite3 **db, const char *dbname);
+int db_open_reader(sqlite3 **db, const char *dbname);
 int db_close(sqlite3 *db);
-int db_insert(sqlite3 *db, const Header *header, const Entry *entries);
-int db_get_space_consumed(sqlite3 *db);
-int db_delete_oldest_bytes(sqlite3 *db, int64_t bytes);
+int db_writer_open(DBWriter *w, const char *dbname);
+int db_writer_close(DBWriter *w);
+int db_begin(sqlite3 *db);
+int db_end(sqlite3 *db);
+int db_rollback(sqlite3 *db);
+int db_insert(DBWriter *w, const Header *header, const void *data);
+uint32_t db_insert_dict(DBWriter *w, const void *dict, size_t size);
+int db_delete_unused_dicts(DBWriter *w);
+int64_t db_get_space_consumed(sqlite3 *db);
+int db_delete_oldest_bytes(DBWriter *w, int64_t bytes, uint32_t max_count);
+int db_read_dicts(sqlite3 *db, ExtractContext *ctx);
 int db_read_data_by_timerange(sqlite3 *db, const Timerange *t,
-                              StateCallback cb);
+                              const Filter *f, StateCallback cb,
+                              uint32_t nr_workers);
+uint32_t db_read_losses(sqlite3 *db, const Timerange *t, Header **headers);
 
 #endif // SQL_H
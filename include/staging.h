@@ -0,0 +1,12 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include "main.h"
+
+void staging_path(char *path, size_t size, const char *storage, uint32_t id);
+void staging_open(State *s, const char *path);
+void staging_close(State *s);
+void staging_committed(State *s);
+uint32_t staging_recover(Global *g);
+
+#endif // STAGING_H
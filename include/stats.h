@@ -0,0 +1,16 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "main.h"
+
+// Every counter has a single writer, readers only need to see it whole
+#define STATS_ADD(counter, n)                                                  \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+
+uint64_t stats_now_usec(void);
+void stats_record(LatencyHistogram *h, uint64_t usec);
+void stats_write(Global *g);
+void *stats_worker(void *targs);
+
+#endif // STATS_H
@@ -0,0 +1,10 @@
+#ifndef SYNOPSIS_H
+#define SYNOPSIS_H
+
+#include "filter.h"
+#include "main.h"
+
+void synopsis_build(State *s);
+bool synopsis_may_match(const Header *h, const Filter *f);
+
+#endif // SYNOPSIS_H
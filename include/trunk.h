@@ -0,0 +1,10 @@
+#ifndef TRUNK_H
+#define TRUNK_H
+
+#include "main.h"
+
+size_t trunk_encode_bound(uint32_t nr_entries);
+size_t trunk_encode(const State *s, void *dst);
+bool trunk_decode(State *s, const void *src, size_t size);
+
+#endif // TRUNK_H
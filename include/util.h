@@ -5,5 +5,7 @@ int check_basedir_exist(const char *storage);
 int check_file_size(const char *storage);
 int check_file_exist(const char *storage);
 enum CompressionType get_compression(const char *flag);
+uint16_t get_nflog_groups(const char *flag, uint16_t **groups,
+                          uint16_t nr_groups);
 
 #endif // UTIL_H
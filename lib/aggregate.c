@@ -0,0 +1,161 @@
+#include "aggregate.h"
+#include <string.h>
+
+#define AGGREGATE_INITIAL_CAPACITY 1024
+
+static const struct {
+    const char *name;
+    enum AggregateField field;
+} aggregate_fields[] = {
+    {"time", AGGREGATE_TIME},   {"uid", AGGREGATE_UID},
+    {"daddr", AGGREGATE_DADDR}, {"dport", AGGREGATE_DPORT},
+    {"proto", AGGREGATE_PROTOCOL},
+};
+
+void aggregate_init(Aggregate *a, uint32_t fields, uint32_t bucket) {
+    memset(a, 0, sizeof(Aggregate));
+    a->fields = fields;
+    a->bucket = bucket;
+    a->capacity = AGGREGATE_INITIAL_CAPACITY;
+    a->groups = calloc(a->capacity, sizeof(AggregateGroup));
+}
+
+void aggregate_destroy(Aggregate *a) { free(a->groups); }
+
+// Accept a comma separated list of fields, e.g. "uid,daddr".  Return 0
+// if the list is empty or holds an unknown field.
+uint32_t aggregate_parse_fields(const char *flag) {
+    char *_flag = strdup(flag), *saveptr = NULL;
+    uint32_t fields = 0;
+    for (char *tok = strtok_r(_flag, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        size_t i = 0;
+        while (i < sizeof(aggregate_fields) / sizeof(*aggregate_fields) &&
+               strcmp(tok, aggregate_fields[i].name))
+            ++i;
+        if (i == sizeof(aggregate_fields) / sizeof(*aggregate_fields)) {
+            fields = 0;
+            break;
+        }
+        fields |= aggregate_fields[i].field;
+    }
+    free(_flag);
+    return fields;
+}
+
+static uint64_t aggregate_hash(const AggregateKey *k) {
+    uint64_t hi, lo;
+    memcpy(&hi, k->daddr.s6_addr, sizeof(hi));
+    memcpy(&lo, k->daddr.s6_addr + 8, sizeof(lo));
+    uint64_t x = (uint64_t)k->time * 0x9e3779b97f4a7c15ULL;
+    x ^= ((uint64_t)k->uid << 32 ^ hi ^ lo) + 0x632be59bd9b4e019ULL +
+         (x << 6) + (x >> 2);
+    x ^= ((uint64_t)k->ip_version << 24 | (uint64_t)k->dport << 8 |
+          k->protocol) +
+         (x << 6) + (x >> 2);
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static bool aggregate_key_equal(const AggregateKey *a, const AggregateKey *b) {
+    return a->time == b->time && a->uid == b->uid &&
+           !memcmp(&a->daddr, &b->daddr, sizeof(struct in6_addr)) &&
+           a->dport == b->dport && a->protocol == b->protocol &&
+           a->ip_version == b->ip_version;
+}
+
+// Groups are never empty, so a zero count marks a free slot
+static AggregateGroup *aggregate_lookup(AggregateGroup *groups,
+                                        uint64_t capacity,
+                                        const AggregateKey *k) {
+    uint64_t i = aggregate_hash(k) & (capacity - 1);
+    while (groups[i].count && !aggregate_key_equal(&groups[i].key, k))
+        i = (i + 1) & (capacity - 1);
+    return &groups[i];
+}
+
+static void aggregate_grow(Aggregate *a) {
+    uint64_t capacity = a->capacity * 2;
+    AggregateGroup *groups = calloc(capacity, sizeof(AggregateGroup));
+    for (uint64_t i = 0; i < a->capacity; ++i)
+        if (a->groups[i].count)
+            *aggregate_lookup(groups, capacity, &a->groups[i].key) =
+                a->groups[i];
+    free(a->groups);
+    a->groups = groups;
+    a->capacity = capacity;
+}
+
+void aggregate_entries(Aggregate *a, const State *s, const uint32_t *sel,
+                       uint32_t nr_sel) {
+    AggregateKey k;
+    memset(&k, 0, sizeof(AggregateKey));
+
+    for (uint32_t i = 0; i < nr_sel; ++i) {
+        const Entry *e = &s->store[sel[i]];
+        if (a->fields & AGGREGATE_TIME)
+            k.time = e->timestamp - e->timestamp % a->bucket;
+        if (a->fields & AGGREGATE_UID)
+            k.uid = e->uid;
+        if (a->fields & AGGREGATE_DADDR && e->ip_version == 6) {
+            k.daddr = s->daddrs6.addrs[e->daddr.s_addr];
+            k.ip_version = 6;
+        } else if (a->fields & AGGREGATE_DADDR) {
+            memset(&k.daddr, 0, 10);
+            memset(&k.daddr.s6_addr[10], 0xff, 2);
+            memcpy(&k.daddr.s6_addr[12], &e->daddr, sizeof(struct in_addr));
+            k.ip_version = 4;
+        }
+        if (a->fields & AGGREGATE_DPORT)
+            k.dport = e->dport;
+        if (a->fields & AGGREGATE_PROTOCOL)
+            k.protocol = e->protocol;
+
+        // Keep the load factor under a half
+        if (a->nr_groups * 2 >= a->capacity)
+            aggregate_grow(a);
+        AggregateGroup *g = aggregate_lookup(a->groups, a->capacity, &k);
+        if (!g->count) {
+            g->key = k;
+            a->nr_groups++;
+        }
+        // Packets, an entry standing for all the packets of its flow
+        g->count += e->count;
+    }
+}
+
+static int aggregate_cmp(const void *_a, const void *_b) {
+    const AggregateGroup *a = _a, *b = _b;
+    if (a->count != b->count)
+        return a->count < b->count ? 1 : -1;
+    if (a->key.time != b->key.time)
+        return a->key.time < b->key.time ? -1 : 1;
+    if (a->key.uid != b->key.uid)
+        return a->key.uid < b->key.uid ? -1 : 1;
+    if (a->key.ip_version != b->key.ip_version)
+        return a->key.ip_version < b->key.ip_version ? -1 : 1;
+    // Addresses are in network byte order
+    int c = memcmp(&a->key.daddr, &b->key.daddr, sizeof(struct in6_addr));
+    if (c)
+        return c;
+    if (a->key.dport != b->key.dport)
+        return a->key.dport < b->key.dport ? -1 : 1;
+    return (a->key.protocol > b->key.protocol) -
+           (a->key.protocol < b->key.protocol);
+}
+
+// Pack the groups at the front of the table, largest count first and
+// ties ordered by key.  The table cannot be aggregated into anymore.
+AggregateGroup *aggregate_sort(Aggregate *a) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < a->capacity; ++i)
+        if (a->groups[i].count)
+            a->groups[n++] = a->groups[i];
+    qsort(a->groups, n, sizeof(AggregateGroup), aggregate_cmp);
+    return a->groups;
+}
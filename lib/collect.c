@@ -22,13 +22,20 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include "commit.h"
+#include "flow.h"
+#include "inet6.h"
 #include "main.h"
+#include "pool.h"
+#include "staging.h"
+#include "stats.h"
+#include <errno.h>
 #include <libnetfilter_log/libnetfilter_log.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stddef.h> // size_t for libnetfilter_log
 #include <stdint.h>
 #include <string.h>
+#include <sys/time.h>
 #include <sys/types.h> // u_int32_t for libnetfilter_log
 #include <time.h>
 
@@ -37,111 +44,280 @@
 // kernel and transmits them as one netlink multipart message to userspace.
 #define NF_NFLOG_QTHRESH 64
 
-Global g;
+// Number of bytes of each packet copied from the kernel: an IPv6 header,
+// room for a few extension headers and a TCP header.  IPv4 headers are
+// shorter.
+#define NF_NFLOG_COPY_SIZE                                                     \
+    (sizeof(struct ip6_hdr) + 32 + sizeof(struct tcphdr))
+
+// Size of the buffer netlink messages are received into.  The kernel is
+// told not to batch more than this at once, which leaves room for
+// NF_NFLOG_COPY_SIZE bytes of each packet plus their metadata.
+#define NF_NFLOG_BUFSIZ (256 * NF_NFLOG_QTHRESH)
+
+// Every packet logged to a group has a sequence number.  Count the
+// packets skipped since the previous one into the trunk being filled:
+// they were dropped by the kernel, most likely because the socket
+// receive buffer overflowed.  The sequence number of packets filtered
+// out by their headers is not fetched, they are assumed in sequence:
+// next_seq is increased for every packet received.
+static void count_lost_packets(NflogPacket *p, State *s) {
+    Netlink *nl = s->netlink_fd;
+    if (p->nfa)
+        p->has_seq = nflog_get_seq(p->nfa, &p->seq) == 0;
+    if (!p->has_seq)
+        return;
+    // Sequence numbers wrap around, and only move forward
+    uint32_t expected = nl->next_seq - 1;
+    if (nl->has_seq && p->seq - expected < UINT32_MAX / 2)
+        s->header->nr_lost += p->seq - expected;
+    nl->has_seq = true;
+    nl->next_seq = p->seq + 1;
+}
 
-static int handle_packet(__attribute__((unused)) struct nflog_g_handle *gh,
-                         __attribute__((unused)) struct nfgenmsg *nfmsg,
-                         struct nflog_data *nfa, void *_s) {
-// log a bursting connection every `BURST_PERIOD` second
-#define BURST_PERIOD 0x4
-#define HASH_ENTRY(e) (e->sport ^ (e->timestamp & ~(BURST_PERIOD - 1)))
-    register const struct iphdr *iph;
+// Time the packet was logged by the kernel in milliseconds since UNIX
+// epoch, or the time it is received if the kernel didn't tell.  Entries
+// of a trunk must be in order, so the time never goes backwards, neither
+// past the previous entry of the group nor past the start of the trunk.
+static int64_t packet_time(const NflogPacket *p, const State *s) {
+    struct timespec ts;
+    int64_t t;
+
+    if (p->has_timestamp) {
+        t = (int64_t)p->timestamp.tv_sec * 1000 + p->timestamp.tv_usec / 1000;
+    } else {
+        // Only millisecond resolution is needed, which the coarse
+        // clock provides without a system call
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        t = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    int64_t min = (int64_t)s->header->start_time * 1000;
+    if (min < s->netlink_fd->prev_entry_time)
+        min = s->netlink_fd->prev_entry_time;
+    return t < min ? min : t;
+}
+
+// Skip the IPv6 header and its extension headers, and return the header
+// of the transport `protocol`.  Return NULL if the ports (and TCP flags)
+// were not copied, or for fragments other than the first one.
+static void *ipv6_transport_header(char *payload, int len,
+                                   uint8_t *protocol) {
+    const struct ip6_hdr *ip6h = (const struct ip6_hdr *)payload;
+    int off = sizeof(struct ip6_hdr);
+    if (len < off)
+        return NULL;
+
+    uint8_t next = ip6h->ip6_nxt;
+    while (true) {
+        switch (next) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+            if (off + 2 > len)
+                return NULL;
+            next = payload[off];
+            off += ((uint8_t)payload[off + 1] + 1) * 8;
+            break;
+        case IPPROTO_FRAGMENT: {
+            const struct ip6_frag *frag = (struct ip6_frag *)(payload + off);
+            if (off + (int)sizeof(struct ip6_frag) > len ||
+                (frag->ip6f_offlg & IP6F_OFF_MASK))
+                return NULL;
+            next = frag->ip6f_nxt;
+            off += sizeof(struct ip6_frag);
+            break;
+        }
+        default:
+            *protocol = next;
+            // Ports come first in both, the TCP flags at byte 13
+            if (off + (next == IPPROTO_TCP ? 14 : 4) > len)
+                return NULL;
+            return payload + off;
+        }
+    }
+}
+
+// Store a packet into the trunk, unless one of the rules below filters
+// it out.  Return 0 if it was stored as a new entry.
+int collect_packet(State *s, NflogPacket *p) {
+    register const struct iphdr *iph = NULL;
+    const struct ip6_hdr *ip6h = NULL;
     register Entry *entry;
     const struct tcphdr *tcph;
     const struct udphdr *udph;
-    char *payload;
+    char *payload = p->payload;
+    int payload_len = p->payload_len;
     void *inner_hdr;
-    uint32_t uid;
-
-    // Store previous data hash (see HASH_ENTRY above) for rate-limiting purpose
-    static uint64_t prev_entry_hash;
+    uint8_t protocol;
 
-    int payload_len = nflog_get_payload(nfa, &payload);
-    State *s = (State *)_s;
+    CollectStats *stats = &s->netlink_fd->stats;
 
-    // only process ipv4 packet
-    if (unlikely(payload_len < 0) || ((payload[0] & 0xf0) != 0x40)) {
-        DEBUG("Ignore non-IPv4 packet");
+    STATS_INC(stats->nr_packets);
+    s->netlink_fd->next_seq++;
+    if (unlikely(payload_len < 1)) {
+        STATS_INC(stats->nr_truncated);
         return 1;
     }
 
-    if (unlikely(s->header->nr_entries >= g.max_nr_entries))
+    // The rest of the batch once the trunk is full has nowhere to go
+    if (unlikely(s->header->nr_entries >= s->global->max_nr_entries)) {
+        s->header->nr_lost++;
+        STATS_INC(stats->nr_trunk_full);
         return 1;
+    }
 
-    iph = (struct iphdr *)payload;
     entry = &(s->store[s->header->nr_entries]);
+    entry->ip_version = (uint8_t)payload[0] >> 4;
+    if (entry->ip_version == 4) {
+        iph = (struct iphdr *)payload;
+        protocol = iph->protocol;
+        inner_hdr = (uint32_t *)iph + iph->ihl;
+    } else if (entry->ip_version == 6) {
+        ip6h = (struct ip6_hdr *)payload;
+        inner_hdr = ipv6_transport_header(payload, payload_len, &protocol);
+        if (!inner_hdr) {
+            STATS_INC(stats->nr_truncated);
+            return 1;
+        }
+    } else {
+        DEBUG("Ignore non-IP packet");
+        STATS_INC(stats->nr_not_ip);
+        return 1;
+    }
 
-    inner_hdr = (uint32_t *)iph + iph->ihl;
     // Only accept TCP / UDP packets
-    if (iph->protocol == IPPROTO_TCP) {
+    if (protocol == IPPROTO_TCP) {
         tcph = (struct tcphdr *)inner_hdr;
         entry->sport = ntohs(tcph->source);
         entry->dport = ntohs(tcph->dest);
 
         // only process SYNC and PSH packet, drop ACK
-        if (!tcph->syn && !tcph->psh)
+        if (!tcph->syn && !tcph->psh) {
+            STATS_INC(stats->nr_ack_only);
             return 1;
-    } else if (iph->protocol == IPPROTO_UDP) {
+        }
+    } else if (protocol == IPPROTO_UDP) {
         udph = (struct udphdr *)inner_hdr;
         entry->sport = ntohs(udph->source);
         entry->dport = ntohs(udph->dest);
     } else {
         DEBUG("Ignore non-TCP/UDP packet");
+        STATS_INC(stats->nr_not_tcp_udp);
         return 1; // Ignore other types of packet
     }
 
-    // get current timestamp
-    time(&entry->timestamp);
-
-    // Rate-limit incoming packets:
-    // Ignore those with identical hash to prevent
-    // packet flooding.  This simple trick is based
-    // on the observation that packet surge usually
-    // originates from one process.  Even if different
-    // processes send simultaneously, the kernel deliver
-    // packets in batch instead in interleaving manner.
-    uint64_t entry_hash = HASH_ENTRY(entry);
-    if (entry_hash == prev_entry_hash)
-        return 1;
-    prev_entry_hash = entry_hash;
+    // Only fetched for the packets filtered by neither of the above
+    if (p->nfa) {
+        p->has_timestamp = nflog_get_timestamp(p->nfa, &p->timestamp) == 0;
+        p->has_uid = nflog_get_uid(p->nfa, &p->uid) == 0;
+    }
+    count_lost_packets(p, s);
+    int64_t t = packet_time(p, s);
 
-    entry->daddr.s_addr = iph->daddr;
-    entry->protocol = iph->protocol;
+    entry->protocol = protocol;
 
     // get sender uid
-    if (nflog_get_uid(nfa, &uid) != 0)
+    if (!p->has_uid) {
+        STATS_INC(stats->nr_no_uid);
         return 1;
-    entry->uid = uid;
+    }
+    entry->uid = p->uid;
 
-    // Advance to next entry
-    s->header->nr_entries++;
+    if (iph)
+        entry->daddr.s_addr = iph->daddr;
+    else
+        entry->daddr.s_addr = inet6_table_add(&s->daddrs6, &ip6h->ip6_dst);
 
-    DEBUG("Recv packet info entry #%d: "
+    // Rate-limit incoming packets:
+    // Packets of a flow already stored within the flow
+    // window are only counted in its entry, to prevent
+    // packet flooding.  Flows are kept per NFLOG group
+    // since each group is received by its own worker.
+    Netlink *nl = s->netlink_fd;
+    uint32_t nr_entries = s->header->nr_entries;
+    uint32_t i = flow_table_lookup(&nl->flows, entry, t,
+                                   s->global->flow_window, nr_entries);
+    if (i != nr_entries) {
+        if (likely(s->store[i].count < UINT32_MAX))
+            s->store[i].count++;
+        STATS_INC(stats->nr_rate_limited);
+        return 1;
+    }
+    nl->prev_entry_time = t;
+    entry->timestamp = t / 1000;
+    entry->msec = t % 1000;
+    entry->count = 1;
+
+    // Advance to next entry.  The entry (and the IPv6 address it refers
+    // to) is written before it is counted, in case the trunk is read
+    // back from its staging file after a crash.
+    __atomic_store_n(&s->header->nr_entries, nr_entries + 1,
+                     __ATOMIC_RELEASE);
+    STATS_INC(stats->nr_stored);
+
+    DEBUG("Recv packet info group #%u entry #%d: "
           "timestamp:\t%ld,\t"
           "daddr:\t%ld,\t"
+          "version:\t%u,\t"
           "transfer:\t%s,\t"
           "uid:\t%d,\t"
           "sport:\t%d,\t"
           "dport:\t%d",
-          s->header->nr_entries, entry->timestamp,
-          (unsigned long)entry->daddr.s_addr,
-          iph->protocol == IPPROTO_TCP ? "TCP" : "UDP", entry->uid,
+          s->netlink_fd->group_id, s->header->nr_entries, entry->timestamp,
+          (unsigned long)entry->daddr.s_addr, entry->ip_version,
+          entry->protocol == IPPROTO_TCP ? "TCP" : "UDP", entry->uid,
           entry->sport, entry->dport);
 
-    // Ignore IPv6 packet for now Q_Q
     return 0;
 }
 
-void collect_open_netlink(Netlink *nl, uint16_t group_id) {
+static int handle_packet(__attribute__((unused)) struct nflog_g_handle *gh,
+                         __attribute__((unused)) struct nfgenmsg *nfmsg,
+                         struct nflog_data *nfa, void *_s) {
+    NflogPacket p;
+    p.payload_len = nflog_get_payload(nfa, &p.payload);
+    p.nfa = nfa;
+    return collect_packet((State *)_s, &p);
+}
+
+// Grow the socket receive buffer beyond the system limit if allowed to,
+// which we usually are as root
+static void set_rcvbuf_size(Netlink *nl, uint32_t rcvbuf_size) {
+    int fd = nflog_fd(nl->fd), size = rcvbuf_size * 1024, actual;
+    socklen_t len = sizeof(actual);
+    if (!rcvbuf_size)
+        return;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        FATAL("Could not set the receive buffer size: %s", strerror(errno));
+
+    // The kernel doubles the size to account for its own bookkeeping
+    if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len) &&
+        actual / 2 < size)
+        WARN("NFLOG group %u: receive buffer capped at %d KiB, see "
+             "net.core.rmem_max",
+             nl->group_id, actual / 2 / 1024);
+}
+
+void collect_open_netlink(Netlink *nl, uint16_t group_id,
+                          uint32_t rcvbuf_size) {
     // open nflog
     if ((nl->fd = nflog_open()) == NULL) {
         FATAL("nflog_open failed");
     }
 
     DEBUG("Opening nflog communication file descriptor");
-
-    // monitor IPv4 packets only
-    if (nflog_bind_pf(nl->fd, AF_INET) < 0) {
+    nl->group_id = group_id;
+    nl->prev_entry_time = 0;
+    nl->has_seq = false;
+    flow_table_init(&nl->flows, g_flow_table_size);
+    set_rcvbuf_size(nl, rcvbuf_size);
+
+    // monitor IPv4 and IPv6 packets
+    if (nflog_bind_pf(nl->fd, AF_INET) < 0 ||
+        nflog_bind_pf(nl->fd, AF_INET6) < 0) {
         FATAL("nflog_bind_pf failed");
     }
 
@@ -154,72 +330,155 @@ void collect_open_netlink(Netlink *nl, uint16_t group_id) {
         FATAL("Cannot bind to NFLOG group %d, is it used by another process?",
               group_id);
 
-    // only copy size of ipv4 header + tcp header
-    int recv_size = sizeof(struct iphdr) + sizeof(struct tcphdr);
-    if (nflog_set_mode(nl->group_fd, NFULNL_COPY_PACKET, recv_size) < 0)
+    // only copy the headers up to the transport one
+    if (nflog_set_mode(nl->group_fd, NFULNL_COPY_PACKET, NF_NFLOG_COPY_SIZE) <
+        0)
         FATAL("Could not set copy mode");
 
     // Batch send 128 packets from kernel to userspace
     if (nflog_set_qthresh(nl->group_fd, NF_NFLOG_QTHRESH))
         FATAL("Could not set qthresh");
+    if (nflog_set_nlbufsiz(nl->group_fd, NF_NFLOG_BUFSIZ))
+        FATAL("Could not set nlbufsiz");
+
+    // Number packets so that losses can be told
+    if (nflog_set_flags(nl->group_fd, NFULNL_CFG_F_SEQ))
+        FATAL("Could not set flags");
 }
 
 void collect_close_netlink(Netlink *nl) {
     nflog_unbind_group(nl->group_fd);
     nflog_close(nl->fd);
+    flow_table_destroy(&nl->flows);
+}
+
+static int64_t monotonic_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Start filling the trunk of a group
+void collect_begin(State *s) {
+    // Write start time
+    time(&s->header->start_time);
+    // Entries of the previous trunk can't be counted into anymore
+    flow_table_clear(&s->netlink_fd->flows);
+    inet6_table_clear(&s->daddrs6);
 }
 
+// Hand the trunk over to the commit worker, or back to the pool if it
+// is empty.  A trunk without entries is still committed if packets were
+// lost while it was filled, which only happens when stopping, so that
+// the losses are recorded.
+void collect_end(State *s) {
+    if (s->header->nr_lost)
+        WARN("NFLOG group %u: %u packets lost while filling the trunk",
+             s->netlink_fd->group_id, s->header->nr_lost);
+    STATS_ADD(s->netlink_fd->stats.nr_lost, s->header->nr_lost);
+    STATS_ADD(s->netlink_fd->stats.nr_overflows, s->header->nr_overflows);
+    if (!s->header->nr_entries && !s->header->nr_lost &&
+        !s->header->nr_overflows) {
+        trunk_pool_put(s);
+        return;
+    }
+
+    // write end time
+    time(&s->header->end_time);
+    s->header->raw_size = s->header->nr_entries * sizeof(Entry);
+
+    s->queued_usec = stats_now_usec();
+    trunk_queue_push(&s->global->commit_queue, s);
+}
+
+// Fill the trunk until it is full, old enough or nfcollect is stopping,
+// then hand it to the commit worker, see collect_end.
 void *collect_worker(void *targs) {
     State *s = (State *)targs;
-    memcpy(&g, s->global, sizeof(Global));
+    Global *g = s->global;
 
     nflog_callback_register(s->netlink_fd->group_fd, &handle_packet, s);
     DEBUG("Registering nflog callback");
 
     int fd = nflog_fd(s->netlink_fd->fd);
-    DEBUG("Recv worker #%lu: main loop starts", pthread_self());
-
-    // Write start time
-    time(&s->header->start_time);
+    DEBUG("Recv worker #%lu: main loop starts (group #%u)", pthread_self(),
+          s->netlink_fd->group_id);
+    collect_begin(s);
 
     int rv;
-    // Must have at least 128 for each packet to account for
-    // sizeof(struct iphdr) + sizeof(struct tcphdr) plus the
-    // size of meta data needed by the library's data structure.
-    char buf[128 * NF_NFLOG_QTHRESH + 1];
-    while (s->header->nr_entries < g.max_nr_entries) {
-        if ((rv = recv(fd, buf, sizeof(buf), 0)) && rv > 0) {
+    char buf[NF_NFLOG_BUFSIZ + 1];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int64_t deadline = monotonic_msec() + (int64_t)g->max_trunk_age * 1000;
+    while (s->header->nr_entries < g->max_nr_entries && !g->stop) {
+        int timeout = g_collect_poll_interval;
+        if (g->max_trunk_age) {
+            int64_t left = deadline - monotonic_msec();
+            if (left <= 0 && s->header->nr_entries)
+                break;
+            // Nothing to commit yet, the trunk starts over, still
+            // accounting for the packets lost so far
+            if (left <= 0) {
+                time(&s->header->start_time);
+                deadline += (int64_t)g->max_trunk_age * 1000;
+                continue;
+            }
+            if (left < timeout)
+                timeout = left;
+        }
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+
+        if ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) && rv > 0) {
+            STATS_INC(s->netlink_fd->stats.nr_recvs);
+            STATS_ADD(s->netlink_fd->stats.nr_recv_bytes, rv);
             DEBUG("Recv worker #%lu: packet received "
                   "(len=%u, #entries=%u)",
                   pthread_self(), rv, s->header->nr_entries);
             nflog_handle_packet(s->netlink_fd->fd, buf, rv);
+        } else if (rv < 0 && errno == ENOBUFS) {
+            // Packets were dropped, the sequence gap tells how many
+            if (!s->header->nr_overflows++)
+                WARN("NFLOG group %u: receive buffer overflow, packets "
+                     "lost, consider a larger --rcvbuf",
+                     s->netlink_fd->group_id);
         }
     }
 
-    // write end time
-    time(&s->header->end_time);
-    s->header->raw_size = s->header->nr_entries * sizeof(Entry);
-
-    pthread_t tid;
-    pthread_create(&tid, NULL, commit, (void *)s);
-    pthread_detach(tid);
+    collect_end(s);
     return NULL;
 }
 
-void state_init(State **s, Netlink *nl, Global *g) {
+// Trunks are kept in the staging file at path `staging` if given, see
+// lib/staging.c, else on the heap
+void state_init(State **s, Netlink *nl, Global *g, const char *staging) {
     assert(s);
-    *s = (State *)malloc(sizeof(State));
+    *s = (State *)calloc(1, sizeof(State));
     (*s)->global = g;
     (*s)->netlink_fd = nl;
-    (*s)->header = (Header *)calloc(sizeof(Header), 1);
+    if (staging) {
+        staging_open(*s, staging);
+    } else {
+        (*s)->header = (Header *)calloc(sizeof(Header), 1);
+        (*s)->store = (Entry *)malloc(sizeof(Entry) * g->max_nr_entries);
+        inet6_table_init(&(*s)->daddrs6, NULL, g->max_nr_entries, true);
+    }
     (*s)->header->compression_type = g->compression_type;
-
-    (*s)->store = (Entry *)malloc(sizeof(Entry) * g->max_nr_entries);
     (*s)->header->nr_entries = 0;
 }
 
+void state_reset(State *s) {
+    memset(s->header, 0, sizeof(Header));
+    s->header->compression_type = s->global->compression_type;
+    s->netlink_fd = NULL;
+}
+
 void state_free(State *s) {
-    free(s->store);
-    free(s->header);
+    if (s->staging) {
+        staging_close(s);
+    } else {
+        inet6_table_destroy(&s->daddrs6);
+        free(s->store);
+        free(s->header);
+    }
     free(s);
 }
@@ -1,109 +1,408 @@
 #include "collect.h"
+#include "commit.h"
+#include "gc.h"
 #include "main.h"
+#include "pool.h"
 #include "sql.h"
+#include "staging.h"
+#include "stats.h"
+#include "synopsis.h"
+#include "trunk.h"
 #include "util.h"
 
-#include <zstd.h>
-
-static void do_gc(sqlite3 *db, State *s) {
-    int64_t cur_size = (int64_t)s->header->raw_size;
-    pthread_mutex_lock(&s->global->storage_consumed_lock);
-    int64_t remain_size =
-        s->global->storage_budget - s->global->storage_consumed - cur_size;
-    int64_t gc_size = 0;
-    if (remain_size <= 0) {
-        gc_size = -remain_size + cur_size * g_gc_rate;
-        if (gc_size >= s->global->storage_consumed)
-            gc_size = s->global->storage_consumed * g_gc_cap;
-        else if (gc_size >= s->global->storage_budget * g_gc_cap)
-            gc_size = s->global->storage_budget * g_gc_cap;
-    }
-    DEBUG("do_gc: gc_size %.2f KB, remain %.2f KB, cur_size, %.2f KB\n",
-          gc_size / 1024.0, remain_size / 1024.0, cur_size / 1024.0);
-    pthread_mutex_unlock(&s->global->storage_consumed_lock);
-
-    uint32_t gc_count = 0;
-    if (gc_size > 0) {
-        gc_count = db_delete_oldest_bytes(db, gc_size);
-        db_vacuum(db);
-    }
-
-    int64_t dbsize = check_file_size(s->global->storage_file);
-    pthread_mutex_lock(&s->global->storage_consumed_lock);
-    s->global->storage_consumed = dbsize;
-    pthread_mutex_unlock(&s->global->storage_consumed_lock);
-
-    if (gc_count) {
-        INFO("gc: storage budget: %.2f MB, storage consumed: %.2f MB, (%.2f "
-             "MB/%d entries) vacuumed",
-             s->global->storage_budget / 1024.0 / 1024.0,
-             s->global->storage_consumed / 1024.0 / 1024.0,
-             gc_size / 1024.0 / 1024.0, gc_count);
-    } else {
-        DEBUG("gc: storage budget: %.2f MB, storage consumed: %.2f MB, skip "
-              "vacuuming",
-              s->global->storage_budget / 1024.0 / 1024.0,
-              s->global->storage_consumed / 1024.0 / 1024.0);
+#include <lz4.h>
+#include <lz4hc.h>
+#include <string.h>
+#include <unistd.h>
+#include <zdict.h>
+
+void committer_init(Committer *c, Global *g) {
+    memset(c, 0, sizeof(Committer));
+    c->g = g;
+
+    // The connection and its prepared statements live as long as
+    // the commit worker, instead of being set up for every trunk
+    db_writer_open(&c->w, g->storage_file);
+
+    c->cctx = ZSTD_createCCtx();
+    if (g->compression_type == COMPRESS_LZ4)
+        c->lz4_state = malloc(LZ4_sizeofState());
+    else if (g->compression_type == COMPRESS_LZ4HC)
+        c->lz4_state = malloc(LZ4_sizeofStateHC());
+    c->encoded_cap = trunk_encode_bound(g->max_nr_entries);
+    c->compressed_cap = ZSTD_compressBound(c->encoded_cap);
+    // lz4 blocks are prefixed with their decompressed size
+    size_t lz4_cap = sizeof(uint32_t) + LZ4_COMPRESSBOUND(c->encoded_cap);
+    if (c->compressed_cap < lz4_cap)
+        c->compressed_cap = lz4_cap;
+    c->encoded = malloc(sizeof(void *) * g->commit_batch);
+    c->compressed = malloc(sizeof(void *) * g->commit_batch);
+    c->encoded_sizes = malloc(sizeof(uint32_t) * g->commit_batch);
+    for (uint32_t i = 0; i < g->commit_batch; ++i) {
+        c->encoded[i] = malloc(c->encoded_cap);
+        c->compressed[i] = malloc(c->compressed_cap);
     }
+
+    if (g->zstd_dict)
+        c->samples = malloc(c->encoded_cap * g_zstd_dict_nr_samples);
+    c->cdicts = calloc(ZSTD_maxCLevel() - ZSTD_minCLevel() + 1,
+                       sizeof(ZSTD_CDict *));
+    c->level = compression_level(g, 0);
 }
 
-static int commit_lz4(State *s, void **buf) {
-    /* TODO */
-    (void)s;
-    (void)buf;
-    return -1;
+static void committer_free_cdicts(Committer *c) {
+    for (int i = 0; i <= ZSTD_maxCLevel() - ZSTD_minCLevel(); ++i) {
+        ZSTD_freeCDict(c->cdicts[i]);
+        c->cdicts[i] = NULL;
+    }
+}
+
+void committer_destroy(Committer *c) {
+    for (uint32_t i = 0; i < c->g->commit_batch; ++i) {
+        free(c->encoded[i]);
+        free(c->compressed[i]);
+    }
+    free(c->encoded);
+    free(c->compressed);
+    free(c->encoded_sizes);
+    free(c->samples);
+    free(c->lz4_state);
+    committer_free_cdicts(c);
+    free(c->cdicts);
+    free(c->dict);
+    free(c->next_dict);
+    ZSTD_freeCCtx(c->cctx);
+    db_writer_close(&c->w);
+}
+
+// Keep the encoded trunk as a training sample, and train a new
+// dictionary once enough samples are collected or the current
+// dictionary is old enough
+static void zstd_dict_sample(Committer *c, const void *src, size_t size) {
+    uint32_t slot = c->nr_samples++ % g_zstd_dict_nr_samples;
+    memcpy(c->samples + slot * c->encoded_cap, src, size);
+    c->sample_sizes[slot] = size;
+    c->nr_trunks_since_train++;
+
+    if (c->nr_samples < g_zstd_dict_nr_samples ||
+        (c->dict && c->nr_trunks_since_train < g_zstd_dict_retrain))
+        return;
+    c->nr_trunks_since_train = 0;
+
+    // ZDICT wants the samples back to back
+    size_t total = 0;
+    uint8_t *samples = malloc(c->encoded_cap * g_zstd_dict_nr_samples);
+    for (uint32_t i = 0; i < g_zstd_dict_nr_samples; ++i) {
+        memcpy(samples + total, c->samples + i * c->encoded_cap,
+               c->sample_sizes[i]);
+        total += c->sample_sizes[i];
+    }
+
+    void *dict = malloc(g_zstd_dict_size);
+    size_t dict_size = ZDICT_trainFromBuffer(dict, g_zstd_dict_size, samples,
+                                             c->sample_sizes,
+                                             g_zstd_dict_nr_samples);
+    free(samples);
+    if (ZDICT_isError(dict_size)) {
+        WARN("zstd: cannot train dictionary: %s",
+             ZDICT_getErrorName(dict_size));
+        free(dict);
+        return;
+    }
+
+    // The rest of the batch is still compressed with the current
+    // dictionary, see committer_store_dict
+    free(c->next_dict);
+    c->next_dict = dict;
+    c->next_dict_size = dict_size;
+}
+
+// Store the dictionary trained while compressing the batch, within the
+// transaction of the batch.  The trunks of the batch referencing the
+// previous dictionary are committed along with it, so GC never sees
+// that dictionary unused in between.
+void committer_store_dict(Committer *c) {
+    if (!c->next_dict)
+        return;
+
+    c->next_dict_id = db_insert_dict(&c->w, c->next_dict, c->next_dict_size);
+    if (!c->next_dict_id) {
+        free(c->next_dict);
+        c->next_dict = NULL;
+    }
+}
+
+// Compress the next batches with the dictionary stored along with the
+// batch, once its transaction is committed
+void committer_use_dict(Committer *c) {
+    if (!c->next_dict_id)
+        return;
+
+    committer_free_cdicts(c);
+    free(c->dict);
+    c->dict = c->next_dict;
+    c->dict_size = c->next_dict_size;
+    c->dict_id = c->next_dict_id;
+    c->next_dict = NULL;
+    c->next_dict_id = 0;
+    INFO("zstd: trained dictionary #%u (%lu bytes) from %d trunks",
+         c->dict_id, c->dict_size, g_zstd_dict_nr_samples);
+}
+
+// The dictionary digested for the given level, created on first use
+static ZSTD_CDict *zstd_dict_at_level(Committer *c, int level) {
+    ZSTD_CDict **cdict = &c->cdicts[level - ZSTD_minCLevel()];
+    if (!*cdict)
+        *cdict = ZSTD_createCDict(c->dict, c->dict_size, level);
+    return *cdict;
+}
+
+// Pick the compression level for the next batch.  With the adaptive
+// level, zstd compresses at high levels while the commit worker keeps
+// up, and falls back to faster levels as trunks queue up behind it,
+// so that receive workers never run out of trunks because compression
+// fell behind.  `nr_pending` is the number of trunks waiting besides
+// the one being committed.
+int compression_level(Global *g, uint32_t nr_pending) {
+    if (!g->adaptive_level)
+        return g->compression_level;
+
+    // Trunks not held by receive workers: the one being committed and
+    // those that may wait behind it.  The level falls linearly as they
+    // queue up, rather than at the first trunk waiting with a small pool.
+    uint32_t spare = g->nr_trunks - g->nr_nl_groups;
+    if (nr_pending > spare)
+        nr_pending = spare;
+
+    int range = g_zstd_level_adaptive_max - g_zstd_level_adaptive_min;
+    int level =
+        g_zstd_level_adaptive_max - range * (int)nr_pending / (int)spare;
+    // Level 0 stands for the default level to zstd
+    return level ? level : -1;
+}
+
+// lz4 blocks do not record their decompressed size, which is not
+// known from the header either for columnar trunks, so it is stored in
+// front of the block
+static int commit_lz4(Committer *c, State *s, const void *src, void *dst) {
+    uint32_t size = s->header->raw_size;
+    char *block = (char *)dst + sizeof(uint32_t);
+    int capacity = c->compressed_cap - sizeof(uint32_t);
+    int csize;
+
+    if (s->global->compression_type == COMPRESS_LZ4HC)
+        csize = LZ4_compress_HC_extStateHC(
+            c->lz4_state, src, block, size, capacity,
+            c->level ? c->level : LZ4HC_CLEVEL_DEFAULT);
+    else
+        csize = LZ4_compress_fast_extState(c->lz4_state, src, block, size,
+                                           capacity, 1);
+    if (csize <= 0) {
+        ERROR("lz4: cannot compress trunk of %u bytes", size);
+        return -1;
+    }
+
+    memcpy(dst, &size, sizeof(uint32_t));
+    s->header->raw_size = sizeof(uint32_t) + csize;
+    if (s->global->compression_type == COMPRESS_LZ4HC)
+        s->header->compression_level = c->level ? c->level
+                                                : LZ4HC_CLEVEL_DEFAULT;
+    return 0;
 }
 
-static int commit_zstd(State *s, void **buf) {
-    size_t const bufsize = ZSTD_compressBound(s->header->raw_size);
+static int commit_zstd(Committer *c, State *s, const void *src, void *dst) {
+    Global *g = s->global;
+    int level = c->level ? c->level : ZSTD_CLEVEL_DEFAULT;
+    size_t rc, csize;
 
-    if (!(*buf = malloc(bufsize)))
-        ERROR("zstd: cannot malloc");
+    // Only large trunks are split among workers, the others are
+    // compressed by the commit worker itself
+    uint32_t workers = s->header->raw_size >= g_zstd_mt_min_size
+                           ? g->compression_workers
+                           : 0;
+    rc = ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_nbWorkers, workers);
+    if (ZSTD_isError(rc)) {
+        WARN("zstd: cannot use %u workers: %s, compressing single threaded",
+             workers, ZSTD_getErrorName(rc));
+        g->compression_workers = 0;
+    }
+    ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_refCDict(c->cctx, c->dict ? zstd_dict_at_level(c, level) : NULL);
 
-    size_t const csize =
-        ZSTD_compress(*buf, bufsize, s->store, s->header->raw_size, 0);
+    csize = ZSTD_compress2(c->cctx, dst, c->compressed_cap, src,
+                           s->header->raw_size);
     if (ZSTD_isError(csize)) {
         ERROR("zstd: %s \n", ZSTD_getErrorName(csize));
-        free(*buf);
         return -1;
     }
 
+    s->header->dict_id = c->dict ? c->dict_id : 0;
+    s->header->compression_level = level;
+    if (c->samples && s->header->nr_entries)
+        zstd_dict_sample(c, src, s->header->raw_size);
     s->header->raw_size = csize;
     return 0;
 }
 
-void *commit(void *targs) {
-    sqlite3 *db = NULL;
-    State *s = (State *)targs;
-    uint32_t size = s->header->raw_size;
-    DEBUG("Committing #%d packets", s->header->nr_entries);
+// Encode and compress the i-th trunk of a batch, returning the buffer
+// to be stored
+void *compress_trunk(Committer *c, State *s, uint32_t i) {
+    void *encoded = c->encoded[i], *compressed = c->compressed[i];
+    int rc = 0;
+
+    synopsis_build(s);
 
-    db_open(&db, s->global->storage_file);
-    db_create_table(db);
+    // Lay the trunk out column by column, see lib/trunk.c
+    s->header->raw_size = c->encoded_sizes[i] = trunk_encode(s, encoded);
+    s->header->format = TRUNK_FORMAT_COLUMNAR_INET6;
 
-    void *buf = NULL;
     switch (s->global->compression_type) {
     case COMPRESS_NONE:
-        break;
+        return encoded;
     case COMPRESS_LZ4:
-        commit_lz4(s, &buf);
+    case COMPRESS_LZ4HC:
+        rc = commit_lz4(c, s, encoded, compressed);
         break;
     case COMPRESS_ZSTD:
-        commit_zstd(s, &buf);
+        rc = commit_zstd(c, s, encoded, compressed);
         break;
     default:
         FATAL("Unknown compression option detected");
     }
 
-    do_gc(db, s);
-    db_insert(db, s->header, buf ? buf : s->store);
-    db_close(db);
+    if (rc < 0) {
+        WARN("Compression failed, storing trunk uncompressed");
+        s->header->compression_type = COMPRESS_NONE;
+        return encoded;
+    }
+    return compressed;
+}
+
+// Insert a batch of trunks in one transaction.  If any of them cannot
+// be inserted, the whole batch is rolled back and false returned.
+static bool insert_trunks(Committer *c, State **batch, void **bufs,
+                          uint32_t n) {
+    db_begin(c->w.db);
+    for (uint32_t i = 0; i < n; ++i) {
+        if (db_insert(&c->w, batch[i]->header, bufs[i]) != SQLITE_DONE) {
+            db_rollback(c->w.db);
+            // Stored again along with the next attempt
+            c->next_dict_id = 0;
+            return false;
+        }
+    }
+    committer_store_dict(c);
+    db_end(c->w.db);
+    committer_use_dict(c);
+    return true;
+}
+
+// Commit a batch of trunks in one transaction, so that they share
+// a single WAL sync instead of paying one each
+static void commit_trunks(Committer *c, State **batch, uint32_t n) {
+    Stats *stats = &c->g->stats;
+    void *bufs[n];
+    uint32_t sizes[n];
+    int64_t batch_size = 0;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        int level = compression_level(
+            c->g, n - 1 - i + trunk_queue_size(&c->g->commit_queue));
+        if (level != c->level)
+            DEBUG("Compression level: %d -> %d", c->level, level);
+        c->level = level;
+
+        sizes[i] = batch[i]->header->raw_size;
+        DEBUG("Committing #%d packets", batch[i]->header->nr_entries);
+        uint64_t start = stats_now_usec();
+        bufs[i] = compress_trunk(c, batch[i], i);
+        stats_record(&stats->compress_latency, stats_now_usec() - start);
+        batch_size += batch[i]->header->raw_size + g_header_row_size;
+    }
 
-    DEBUG("Committed #%d packets, compressed size: %u/%u",
-          s->header->nr_entries, s->header->raw_size, size);
-    if (buf)
-        free(buf);
-    state_free(s);
+    uint64_t start = stats_now_usec();
+    int retry = g_sqlite_nr_fail_retry;
+    while (!insert_trunks(c, batch, bufs, n)) {
+        if (--retry) {
+            WARN("Can't insert %u trunks, retrying", n);
+            sleep(1);
+            continue;
+        }
+        // The entries of staged trunks are still in their staging files,
+        // and committed on the next start
+        if (c->g->staging)
+            FATAL("Can't insert %u trunks, leaving them staged", n);
+        ERROR("Can't insert %u trunks, dropping them", n);
+        return;
+    }
+    for (uint32_t i = 0; i < n; ++i)
+        if (batch[i]->staging)
+            staging_committed(batch[i]);
+    uint64_t end = stats_now_usec();
+    stats_record(&stats->insert_latency, end - start);
+    for (uint32_t i = 0; i < n; ++i) {
+        stats_record(&stats->commit_latency, end - batch[i]->queued_usec);
+        STATS_ADD(stats->nr_entries_committed, batch[i]->header->nr_entries);
+        STATS_ADD(stats->raw_bytes, sizes[i]);
+        STATS_ADD(stats->encoded_bytes, c->encoded_sizes[i]);
+        STATS_ADD(stats->compressed_bytes, batch[i]->header->raw_size);
+    }
+    STATS_ADD(stats->nr_trunks_committed, n);
+
+    // Space is recycled by the GC worker in the background
+    gc_account(c->g, batch_size);
+
+    for (uint32_t i = 0; i < n; ++i)
+        DEBUG("Committed #%d packets, compressed size: %u/%u",
+              batch[i]->header->nr_entries, batch[i]->header->raw_size,
+              sizes[i]);
+}
+
+// Gather the trunks ready to be committed, waiting at most
+// commit_delay ms for the batch to fill up.  Return 0 once the commit
+// queue is closed and drained.
+static uint32_t gather_trunks(Global *g, State **batch) {
+    uint32_t n = 0;
+    if (!(batch[n++] = trunk_queue_pop(&g->commit_queue)))
+        return 0;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += g->commit_delay / 1000;
+    deadline.tv_nsec += (g->commit_delay % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (n < g->commit_batch) {
+        State *s = g->commit_delay
+                       ? trunk_queue_timed_pop(&g->commit_queue, &deadline)
+                       : trunk_queue_try_pop(&g->commit_queue);
+        if (!s)
+            break;
+        batch[n++] = s;
+    }
+
+    return n;
+}
+
+void *commit_worker(void *targs) {
+    Global *g = (Global *)targs;
+    State *batch[g->commit_batch];
+    Committer c;
+    DEBUG("Commit worker #%lu: main loop starts", pthread_self());
+
+    committer_init(&c, g);
+
+    uint32_t n;
+    while ((n = gather_trunks(g, batch))) {
+        commit_trunks(&c, batch, n);
+        // Recycle the trunks for the receive workers
+        for (uint32_t i = 0; i < n; ++i)
+            trunk_pool_put(batch[i]);
+    }
 
+    committer_destroy(&c);
     return NULL;
 }
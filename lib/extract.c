@@ -1,20 +1,64 @@
+#include "extract.h"
+#include "inet6.h"
 #include "main.h"
+#include "trunk.h"
 #include <errno.h>
+#include <lz4.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #define ZSTD_STATIC_LINKING_ONLY // ZSTD_findDecompressedSize
 #include <zstd.h>
 
-static bool extract_default(State *s, const void *src) {
-    s->store = malloc(s->header->raw_size);
-    memcpy(s->store, src, s->header->raw_size);
-    return true;
+// Size of the trunk once decompressed, exact for the row format,
+// an upper bound for the columnar one
+static size_t decompressed_bound(const Header *h) {
+    if (h->format == TRUNK_FORMAT_ROW)
+        return (size_t)h->nr_entries * g_row_entry_size;
+    return trunk_encode_bound(h->nr_entries);
+}
+
+void extract_init(ExtractContext *ctx) {
+    memset(ctx, 0, sizeof(ExtractContext));
+    ctx->dctx = ZSTD_createDCtx();
+}
+
+void extract_add_dict(ExtractContext *ctx, uint32_t id, const void *dict,
+                      size_t size) {
+    if (id >= ctx->nr_ddicts) {
+        ctx->ddicts = realloc(ctx->ddicts, sizeof(ZSTD_DDict *) * (id + 1));
+        memset(ctx->ddicts + ctx->nr_ddicts, 0,
+               sizeof(ZSTD_DDict *) * (id + 1 - ctx->nr_ddicts));
+        ctx->nr_ddicts = id + 1;
+    }
+    ZSTD_freeDDict(ctx->ddicts[id]);
+    ctx->ddicts[id] = ZSTD_createDDict(dict, size);
+}
+
+void extract_destroy(ExtractContext *ctx) {
+    for (uint32_t i = 0; i < ctx->nr_ddicts && !ctx->shared_ddicts; ++i)
+        ZSTD_freeDDict(ctx->ddicts[i]);
+    if (!ctx->shared_ddicts)
+        free(ctx->ddicts);
+    free(ctx->buf);
+    ZSTD_freeDCtx(ctx->dctx);
 }
 
-static bool extract_zstd(State *s, const void *src) {
+// Return a scratch buffer of at least `size` bytes, reused by all the
+// trunks of an extraction
+static void *extract_buffer(ExtractContext *ctx, size_t size) {
+    if (size > ctx->buf_size) {
+        free(ctx->buf);
+        ctx->buf = malloc(size);
+        ctx->buf_size = size;
+    }
+    return ctx->buf;
+}
+
+static bool extract_zstd(ExtractContext *ctx, State *s, const void *src,
+                         void **dst, size_t *dst_size) {
     assert(src);
-    size_t const expected_decom_size = s->header->nr_entries * sizeof(Entry);
+    size_t const bound = decompressed_bound(s->header);
 
     size_t const r = ZSTD_findDecompressedSize(src, s->header->raw_size);
     if (r == ZSTD_CONTENTSIZE_ERROR)
@@ -23,45 +67,328 @@ static bool extract_zstd(State *s, const void *src) {
         FATAL(
             "zstd: original size unknown. Use streaming decompression instead");
 
-    if (r != expected_decom_size) {
+    if (r > bound ||
+        (s->header->format == TRUNK_FORMAT_ROW && r != bound)) {
         WARN("zstd: expected decompressed size: %ld, got: %ld, skipping "
              "decompression",
-             expected_decom_size, r);
+             bound, r);
         return false;
     }
 
-    s->store = malloc(expected_decom_size);
-    size_t const actual_decom_size = ZSTD_decompress(
-        s->store, expected_decom_size, src, s->header->raw_size);
+    ZSTD_DDict *ddict = NULL;
+    uint32_t dict_id = s->header->dict_id;
+    if (dict_id) {
+        if (dict_id >= ctx->nr_ddicts || !ctx->ddicts[dict_id]) {
+            WARN("zstd: dictionary #%u not found, skipping trunk", dict_id);
+            return false;
+        }
+        ddict = ctx->ddicts[dict_id];
+    }
+
+    // Decompressed into the scratch buffer the trunk is decoded from
+    *dst = extract_buffer(ctx, r);
+    size_t const actual_decom_size =
+        ddict ? ZSTD_decompress_usingDDict(ctx->dctx, *dst, r, src,
+                                           s->header->raw_size, ddict)
+              : ZSTD_decompressDCtx(ctx->dctx, *dst, r, src,
+                                    s->header->raw_size);
 
-    if (actual_decom_size != expected_decom_size) {
+    if (actual_decom_size != r) {
         FATAL("zstd: error decoding current file: %s \n",
               ZSTD_getErrorName(actual_decom_size));
     }
 
+    *dst_size = r;
     return true;
 }
 
-static bool extract_lz4(State *s, const void *src) {
-    // TODO
-    (void)s;
-    (void)src;
+// The block is prefixed with its decompressed size, see commit_lz4
+static bool extract_lz4(ExtractContext *ctx, State *s, const void *src,
+                        void **dst, size_t *dst_size) {
+    assert(src);
+    size_t const bound = decompressed_bound(s->header);
+    uint32_t r;
+
+    if (s->header->raw_size < sizeof(uint32_t)) {
+        WARN("lz4: trunk too short, skipping decompression");
+        return false;
+    }
+    memcpy(&r, src, sizeof(uint32_t));
+    if (r > bound) {
+        WARN("lz4: expected decompressed size: %ld, got: %u, skipping "
+             "decompression",
+             bound, r);
+        return false;
+    }
+
+    *dst = extract_buffer(ctx, r);
+    int const actual_decom_size = LZ4_decompress_safe(
+        (const char *)src + sizeof(uint32_t), *dst,
+        s->header->raw_size - sizeof(uint32_t), r);
+
+    if (actual_decom_size < 0 || (uint32_t)actual_decom_size != r) {
+        WARN("lz4: error decoding trunk, skipping");
+        return false;
+    }
+
+    *dst_size = r;
     return true;
 }
 
-bool extract(State *s, const void *src) {
+// Turn the decompressed trunk into an array of Entry
+static bool extract_decode(State *s, const void *src, size_t size) {
+    uint32_t nr_entries = s->header->nr_entries;
+
+    switch (s->header->format) {
+    case TRUNK_FORMAT_ROW:
+        if (size != (size_t)nr_entries * g_row_entry_size) {
+            WARN("extract: expected trunk size: %lu, got: %lu",
+                 (size_t)nr_entries * g_row_entry_size, size);
+            return false;
+        }
+        // Row entries have no packet count, and their milliseconds were
+        // padding left uninitialized
+        memset(s->store, 0, nr_entries * sizeof(Entry));
+        for (uint32_t i = 0; i < nr_entries; ++i) {
+            memcpy(&s->store[i], (const uint8_t *)src + i * g_row_entry_size,
+                   g_row_entry_size);
+            s->store[i].msec = 0;
+            s->store[i].count = 1;
+            s->store[i].ip_version = 4;
+        }
+        inet6_table_reserve(&s->daddrs6, 0);
+        return true;
+    case TRUNK_FORMAT_COLUMNAR:
+    case TRUNK_FORMAT_COLUMNAR_MSEC:
+    case TRUNK_FORMAT_COLUMNAR_COUNT:
+    case TRUNK_FORMAT_COLUMNAR_INET6:
+        return trunk_decode(s, src, size);
+    default:
+        WARN("extract: unknown trunk format %d, skipping trunk",
+             s->header->format);
+        return false;
+    }
+}
+
+// Entries of a trunk are ordered by timestamp, so the entries within
+// a time range are located by binary search.  Return the index of the
+// first entry not older than `t`, in milliseconds since UNIX epoch.
+uint32_t entry_lower_bound(const Entry *store, uint32_t nr_entries,
+                           int64_t t) {
+    uint32_t lo = 0, hi = nr_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ENTRY_TIME_MSEC(&store[mid]) < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Extract a trunk into s->store, which is allocated unless provided by
+// the caller
+bool extract(ExtractContext *ctx, State *s, const void *src) {
+    void *buf = NULL;
+    size_t size = s->header->raw_size;
+    bool ok;
+
+    if (!s->store)
+        s->store = malloc(s->header->nr_entries * sizeof(Entry));
+
     switch (s->header->compression_type) {
     case COMPRESS_NONE:
         DEBUG("extract: extract without compression\n");
-        return extract_default(s, src);
+        ok = true;
+        break;
     case COMPRESS_LZ4:
+    case COMPRESS_LZ4HC:
+        // nfcollect <= 0.2 stored `-c lz4` trunks uncompressed, as rows,
+        // while lz4 trunks have been columnar ever since
+        if (s->header->format == TRUNK_FORMAT_ROW) {
+            DEBUG("extract: extract legacy lz4 trunk without compression");
+            ok = true;
+            break;
+        }
         DEBUG("extract: extract with compression algorithm: lz4");
-        return extract_lz4(s, src);
+        ok = extract_lz4(ctx, s, src, &buf, &size);
+        break;
     case COMPRESS_ZSTD:
         DEBUG("extract: extract with compression algorithm: zstd");
-        return extract_zstd(s, src);
+        ok = extract_zstd(ctx, s, src, &buf, &size);
+        break;
     // Must not reach here ...
     default:
         FATAL("Unknown compression option detected");
     }
+
+    if (ok)
+        ok = extract_decode(s, buf ? buf : src, size);
+    return ok;
+}
+
+// Select the entries of an extracted trunk within the time range and
+// matching the filter, before anything is formatted
+static void extract_filter(ExtractPool *p, ExtractJob *job) {
+    const Entry *store = job->s.store;
+    uint32_t nr_entries = job->header.nr_entries;
+    uint32_t begin = entry_lower_bound(store, nr_entries, p->range->from);
+    uint32_t end = entry_lower_bound(store, nr_entries, p->range->until);
+
+    if (nr_entries > job->sel_cap) {
+        free(job->sel);
+        job->sel = malloc(sizeof(uint32_t) * nr_entries);
+        job->sel_cap = nr_entries;
+    }
+    job->nr_sel = filter_entries(p->filter, &job->s, begin, end, job->sel);
+}
+
+static void extract_job_run(ExtractContext *ctx, ExtractJob *job) {
+    uint32_t nr_entries = job->header.nr_entries;
+    if (nr_entries > job->store_cap) {
+        free(job->store);
+        job->store = malloc(nr_entries * sizeof(Entry));
+        job->store_cap = nr_entries;
+    }
+    job->s.store = job->store;
+    job->ok = extract(ctx, &job->s, job->src);
+    if (job->ok)
+        extract_filter(ctx->pool, job);
+}
+
+static void *extract_pool_worker(void *targs) {
+    ExtractContext *ctx = (ExtractContext *)targs;
+    ExtractPool *p = ctx->pool;
+
+    pthread_mutex_lock(&p->lock);
+    while (true) {
+        while (!p->stop && p->claimed == p->submitted)
+            pthread_cond_wait(&p->job_ready, &p->lock);
+        if (p->stop)
+            break;
+        ExtractJob *job = &p->jobs[p->claimed++ % p->window];
+        pthread_mutex_unlock(&p->lock);
+
+        extract_job_run(ctx, job);
+
+        pthread_mutex_lock(&p->lock);
+        job->done = true;
+        pthread_cond_broadcast(&p->job_done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Each worker has its own decompression context, while the zstd
+// dictionaries of `dicts` are shared by all of them.  A single worker
+// would only hand trunks over from one thread to another, so then trunks
+// are extracted by the submitting thread itself, one at a time.
+void extract_pool_init(ExtractPool *p, uint32_t nr_workers,
+                       const ExtractContext *dicts, const Timerange *range,
+                       const Filter *filter) {
+    memset(p, 0, sizeof(ExtractPool));
+    p->range = range;
+    p->filter = filter;
+    p->nr_workers = nr_workers > 1 ? nr_workers : 0;
+    // Enough trunks in flight to keep every worker busy while the
+    // oldest one is being consumed
+    p->window = p->nr_workers ? p->nr_workers * 2 : 1;
+    p->jobs = calloc(p->window, sizeof(ExtractJob));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->job_ready, NULL);
+    pthread_cond_init(&p->job_done, NULL);
+
+    uint32_t nr_ctxs = p->nr_workers ? p->nr_workers : 1;
+    p->workers = malloc(sizeof(pthread_t) * p->nr_workers);
+    p->ctxs = malloc(sizeof(ExtractContext) * nr_ctxs);
+    for (uint32_t i = 0; i < nr_ctxs; ++i) {
+        extract_init(&p->ctxs[i]);
+        p->ctxs[i].ddicts = dicts->ddicts;
+        p->ctxs[i].nr_ddicts = dicts->nr_ddicts;
+        p->ctxs[i].shared_ddicts = true;
+        p->ctxs[i].pool = p;
+    }
+    for (uint32_t i = 0; i < p->nr_workers; ++i)
+        pthread_create(&p->workers[i], NULL, extract_pool_worker,
+                       &p->ctxs[i]);
+}
+
+void extract_pool_destroy(ExtractPool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->job_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    for (uint32_t i = 0; i < p->nr_workers; ++i)
+        pthread_join(p->workers[i], NULL);
+    for (uint32_t i = 0; i < (p->nr_workers ? p->nr_workers : 1); ++i)
+        extract_destroy(&p->ctxs[i]);
+    for (uint32_t i = 0; i < p->window; ++i) {
+        free(p->jobs[i].src);
+        free(p->jobs[i].store);
+        free(p->jobs[i].sel);
+        inet6_table_destroy(&p->jobs[i].s.daddrs6);
+    }
+    free(p->workers);
+    free(p->ctxs);
+    free(p->jobs);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->job_ready);
+    pthread_cond_destroy(&p->job_done);
+}
+
+// Only touched by the thread submitting and consuming the trunks
+bool extract_pool_full(ExtractPool *p) {
+    return p->submitted - p->emitted == p->window;
+}
+
+bool extract_pool_empty(ExtractPool *p) { return p->submitted == p->emitted; }
+
+// The next free slot, to be filled by the caller then submitted
+ExtractJob *extract_pool_reserve(ExtractPool *p) {
+    assert(!extract_pool_full(p));
+    ExtractJob *job = &p->jobs[p->submitted % p->window];
+    memset(&job->header, 0, sizeof(Header));
+    job->s.header = &job->header;
+    job->s.store = NULL;
+    return job;
+}
+
+// Source buffer of the job, grown to hold at least `size` bytes
+void *extract_job_buffer(ExtractJob *job, size_t size) {
+    if (size > job->src_cap) {
+        free(job->src);
+        job->src = malloc(size);
+        job->src_cap = size;
+    }
+    return job->src;
+}
+
+void extract_pool_submit(ExtractPool *p) {
+    if (!p->nr_workers) {
+        ExtractJob *job = &p->jobs[p->submitted++ % p->window];
+        extract_job_run(&p->ctxs[0], job);
+        job->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->jobs[p->submitted++ % p->window].done = false;
+    pthread_cond_signal(&p->job_ready);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Wait for the oldest trunk submitted to be extracted and hand it back,
+// valid until its slot is reserved again
+ExtractJob *extract_pool_next(ExtractPool *p) {
+    assert(!extract_pool_empty(p));
+    ExtractJob *job = &p->jobs[p->emitted % p->window];
+
+    pthread_mutex_lock(&p->lock);
+    while (!job->done)
+        pthread_cond_wait(&p->job_done, &p->lock);
+    p->emitted++;
+    pthread_mutex_unlock(&p->lock);
+
+    return job;
 }
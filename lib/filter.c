@@ -0,0 +1,170 @@
+#include "filter.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+// Entries are filtered batch by batch: each predicate turns a batch
+// into a mask with a tight, branch-free loop the compiler can
+// vectorize, then the surviving indices are gathered at once
+#define FILTER_BATCH 256
+
+static long parse_number(const char *flag, const char *what, long max) {
+    char *end;
+    errno = 0;
+    long n = strtol(flag, &end, 10);
+    if (errno || *end || end == flag || n < 0 || n > max)
+        FATAL("Invalid %s: %s", what, flag);
+    return n;
+}
+
+void filter_parse_uid(Filter *f, const char *flag) {
+    f->uid = parse_number(flag, "uid", UINT32_MAX);
+    f->fields |= FILTER_UID;
+}
+
+// Accept a port or an inclusive range of ports, e.g. "80" or "1-1023"
+void filter_parse_port(Filter *f, enum FilterField field, const char *flag) {
+    char *_flag = strdup(flag), *sep = strchr(_flag, '-');
+    uint16_t min, max;
+
+    if (sep)
+        *sep = '\0';
+    min = parse_number(_flag, "port", UINT16_MAX);
+    max = sep ? parse_number(sep + 1, "port", UINT16_MAX) : min;
+    if (min > max)
+        FATAL("Invalid port range: %s", flag);
+    free(_flag);
+
+    if (field == FILTER_SPORT) {
+        f->sport_min = min;
+        f->sport_max = max;
+    } else {
+        f->dport_min = min;
+        f->dport_max = max;
+    }
+    f->fields |= field;
+}
+
+// Accept an IPv4 or IPv6 address or network in CIDR notation, e.g.
+// "10.0.0.0/8" or "2001:db8::/32"
+void filter_parse_daddr(Filter *f, const char *flag) {
+    char *_flag = strdup(flag), *sep = strchr(_flag, '/');
+    bool inet6 = strchr(_flag, ':') != NULL;
+    long len = inet6 ? 128 : 32;
+
+    if (sep) {
+        *sep = '\0';
+        len = parse_number(sep + 1, "prefix length", len);
+    }
+    if (inet6) {
+        if (inet_pton(AF_INET6, _flag, &f->daddr6) != 1)
+            FATAL("Invalid destination address: %s", flag);
+        memset(&f->daddr6_mask, 0, sizeof(struct in6_addr));
+        for (long i = 0; i < len; ++i)
+            f->daddr6_mask.s6_addr[i / 8] |= 0x80 >> (i % 8);
+        for (int i = 0; i < 16; ++i)
+            f->daddr6.s6_addr[i] &= f->daddr6_mask.s6_addr[i];
+        f->daddr_version = 6;
+    } else {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, _flag, &addr) != 1)
+            FATAL("Invalid destination address: %s", flag);
+        f->daddr_mask = len ? htonl(~0u << (32 - len)) : 0;
+        f->daddr = addr.s_addr & f->daddr_mask;
+        f->daddr_version = 4;
+    }
+    free(_flag);
+    f->fields |= FILTER_DADDR;
+}
+
+static bool filter_daddr6(const Filter *f, const struct in6_addr *addr) {
+    for (int i = 0; i < 16; ++i)
+        if ((addr->s6_addr[i] & f->daddr6_mask.s6_addr[i]) !=
+            f->daddr6.s6_addr[i])
+            return false;
+    return true;
+}
+
+void filter_parse_protocol(Filter *f, const char *flag) {
+    if (!strcasecmp(flag, "tcp"))
+        f->protocol = IPPROTO_TCP;
+    else if (!strcasecmp(flag, "udp"))
+        f->protocol = IPPROTO_UDP;
+    else
+        f->protocol = parse_number(flag, "protocol", UINT8_MAX);
+    f->fields |= FILTER_PROTOCOL;
+}
+
+// `match6` tells whether each IPv6 address of the trunk is in the
+// filtered network, if filtering on an IPv6 network
+static void filter_batch(const Filter *f, const Entry *e, uint32_t n,
+                         const uint8_t *match6, uint8_t *match) {
+    memset(match, 1, n);
+
+    if (f->fields & FILTER_UID) {
+        uint32_t uid = f->uid;
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= e[i].uid == uid;
+    }
+    // A range check with a single unsigned comparison
+    if (f->fields & FILTER_SPORT) {
+        uint16_t min = f->sport_min, span = f->sport_max - f->sport_min;
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= (uint16_t)(e[i].sport - min) <= span;
+    }
+    if (f->fields & FILTER_DPORT) {
+        uint16_t min = f->dport_min, span = f->dport_max - f->dport_min;
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= (uint16_t)(e[i].dport - min) <= span;
+    }
+    if ((f->fields & FILTER_DADDR) && f->daddr_version == 4) {
+        uint32_t net = f->daddr, mask = f->daddr_mask;
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= (e[i].ip_version == 4) &
+                        ((e[i].daddr.s_addr & mask) == net);
+    }
+    // The daddr of IPv6 entries indexes the address table of the trunk
+    if ((f->fields & FILTER_DADDR) && f->daddr_version == 6) {
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= e[i].ip_version == 6 && match6[e[i].daddr.s_addr];
+    }
+    if (f->fields & FILTER_PROTOCOL) {
+        uint8_t protocol = f->protocol;
+        for (uint32_t i = 0; i < n; ++i)
+            match[i] &= e[i].protocol == protocol;
+    }
+}
+
+// Store the indices of the entries in [begin, end) matching the filter
+// into `sel`, which must hold end - begin indices, and return how many
+uint32_t filter_entries(const Filter *f, const State *s, uint32_t begin,
+                        uint32_t end, uint32_t *sel) {
+    uint8_t match[FILTER_BATCH], *match6 = NULL;
+    uint32_t nr_sel = 0;
+
+    if (!f->fields) {
+        for (uint32_t i = begin; i < end; ++i)
+            sel[nr_sel++] = i;
+        return nr_sel;
+    }
+
+    // Match each distinct IPv6 address once rather than once per entry
+    if ((f->fields & FILTER_DADDR) && f->daddr_version == 6) {
+        match6 = malloc(s->daddrs6.size + 1);
+        for (uint32_t i = 0; i < s->daddrs6.size; ++i)
+            match6[i] = filter_daddr6(f, &s->daddrs6.addrs[i]);
+    }
+
+    for (uint32_t b = begin; b < end; b += FILTER_BATCH) {
+        uint32_t n = end - b < FILTER_BATCH ? end - b : FILTER_BATCH;
+        filter_batch(f, s->store + b, n, match6, match);
+        // Write every index, only keep the matching ones
+        for (uint32_t i = 0; i < n; ++i) {
+            sel[nr_sel] = b + i;
+            nr_sel += match[i];
+        }
+    }
+    free(match6);
+    return nr_sel;
+}
@@ -0,0 +1,88 @@
+// Flow table
+//
+// Packets are deduplicated by flow, i.e. by (uid, daddr, dport, sport,
+// protocol, IP version): the first packet of a flow is stored as an
+// entry, and the following ones within the flow window are only counted
+// in that entry.
+// Once the window is over, the next packet starts a new entry, so a
+// long-lived flow still shows up regularly.
+//
+// The table has a fixed number of slots and is probed linearly over a
+// few neighbouring slots, which share cache lines.  When all of them
+// hold live flows the oldest one is evicted: its next packet merely
+// starts a new entry, nothing is lost.  Entry indices only make sense
+// within one trunk, so the table is cleared whenever a trunk starts.
+
+#include "flow.h"
+#include <string.h>
+
+void flow_table_init(FlowTable *ft, uint32_t nr_slots) {
+    assert(nr_slots && !(nr_slots & (nr_slots - 1)));
+    ft->slots = calloc(nr_slots, sizeof(FlowSlot));
+    ft->mask = nr_slots - 1;
+}
+
+void flow_table_destroy(FlowTable *ft) {
+    free(ft->slots);
+    ft->slots = NULL;
+}
+
+void flow_table_clear(FlowTable *ft) {
+    memset(ft->slots, 0, (ft->mask + 1) * sizeof(FlowSlot));
+}
+
+// splitmix64 finalizer over the packed flow key
+static uint32_t flow_hash(const Entry *e) {
+    uint64_t x = ((uint64_t)e->daddr.s_addr << 32 | e->uid) ^
+                 ((uint64_t)e->ip_version << 40 | (uint64_t)e->sport << 24 |
+                  (uint64_t)e->dport << 8 | e->protocol) *
+                     0x9e3779b97f4a7c15ULL;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static bool flow_equal(const FlowSlot *slot, const Entry *e) {
+    return slot->daddr == e->daddr.s_addr && slot->uid == e->uid &&
+           slot->sport == e->sport && slot->dport == e->dport &&
+           slot->protocol == e->protocol &&
+           slot->ip_version == e->ip_version;
+}
+
+// Look up the flow of entry `e`, received at `t` (ms since UNIX epoch).
+// Return the index of the entry the packet is to be counted in, or
+// `index` if it has to be stored as a new entry at `index`.
+uint32_t flow_table_lookup(FlowTable *ft, const Entry *e, int64_t t,
+                           uint32_t window, uint32_t index) {
+    if (!window)
+        return index;
+
+    uint32_t h = flow_hash(e);
+    FlowSlot *victim = NULL;
+    for (uint32_t i = 0; i < g_flow_table_probes; ++i) {
+        FlowSlot *slot = &ft->slots[(h + i) & ft->mask];
+        if (slot->start && flow_equal(slot, e)) {
+            if (t - slot->start < window)
+                return slot->index;
+            // Window over, the flow starts a new entry in its slot
+            victim = slot;
+            break;
+        }
+        // Free slots, having start 0, are the oldest
+        if (!victim || slot->start < victim->start)
+            victim = slot;
+    }
+
+    victim->daddr = e->daddr.s_addr;
+    victim->uid = e->uid;
+    victim->sport = e->sport;
+    victim->dport = e->dport;
+    victim->protocol = e->protocol;
+    victim->ip_version = e->ip_version;
+    victim->index = index;
+    victim->start = t;
+    return index;
+}
@@ -0,0 +1,159 @@
+#include "gc.h"
+#include "main.h"
+#include "sql.h"
+#include "stats.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hand free pages beyond the storage budget back to the OS, at most
+// until the deadline.  Free pages within budget are kept, since new
+// trunks reuse them without growing the file.
+static void gc_trim(sqlite3 *db, int64_t budget, double deadline) {
+    if (!db_is_incremental_vacuum(db))
+        return;
+
+    while (now() < deadline) {
+        int64_t freelist = db_get_freelist_size(db);
+        int64_t excess = db_get_space_consumed(db) + freelist - budget;
+        if (excess <= 0 || freelist <= 0)
+            break;
+        db_incremental_vacuum(db, g_gc_vacuum_pages);
+    }
+}
+
+// One GC round: delete the oldest trunks in small transactions until
+// usage drops below the low watermark or the time budget runs out.
+// Return the number of trunks deleted.
+static uint32_t gc_round(DBWriter *w, Global *g) {
+    double start = now(), deadline = start + g_gc_time_budget / 1000.0;
+    int64_t budget = g->storage_budget;
+    int64_t consumed = db_get_space_consumed(w->db), before = consumed;
+    uint32_t gc_count = 0;
+
+    if (consumed > budget) {
+        int64_t target = budget * g_gc_cap;
+        while (consumed > target && now() < deadline) {
+            int count = db_delete_oldest_bytes(w, consumed - target, g_gc_rate);
+            if (!count)
+                break;
+            gc_count += count;
+            consumed = db_get_space_consumed(w->db);
+        }
+    }
+    // Dictionaries only the recycled trunks were compressed with
+    if (gc_count)
+        db_delete_unused_dicts(w);
+    gc_trim(w->db, budget, deadline);
+
+    pthread_mutex_lock(&g->storage_consumed_lock);
+    g->storage_consumed = consumed;
+    pthread_mutex_unlock(&g->storage_consumed_lock);
+
+    STATS_INC(g->stats.nr_gc_rounds);
+    STATS_ADD(g->stats.nr_gc_trunks, gc_count);
+    STATS_ADD(g->stats.gc_usec, (now() - start) * 1e6);
+    if (gc_count) {
+        INFO("gc: storage budget: %.2f MB, storage consumed: %.2f MB, (%.2f "
+             "MB/%d trunks) recycled in %.1f ms",
+             budget / 1024.0 / 1024.0, consumed / 1024.0 / 1024.0,
+             (before - consumed) / 1024.0 / 1024.0, gc_count,
+             (now() - start) * 1e3);
+    } else {
+        DEBUG("gc: storage budget: %.2f MB, storage consumed: %.2f MB, skip "
+              "recycling",
+              budget / 1024.0 / 1024.0, consumed / 1024.0 / 1024.0);
+    }
+    return gc_count;
+}
+
+void *gc_worker(void *targs) {
+    Global *g = (Global *)targs;
+    DBWriter w;
+    DEBUG("GC worker #%lu: main loop starts", pthread_self());
+
+    // GC has a connection of its own and only holds the write lock
+    // for one small batch at a time, so inserts never wait for long
+    db_writer_open(&w, g->storage_file);
+
+    // Time (ms) to wait after a round that could not delete anything
+    // while over budget, doubled each time it happens again
+    uint32_t backoff = g_gc_time_budget;
+    while (!g->stop) {
+        uint32_t gc_count = gc_round(&w, g);
+
+        pthread_mutex_lock(&g->storage_consumed_lock);
+        uint32_t wait = g_gc_interval * 1000;
+        if (g->storage_consumed > g->storage_budget && gc_count) {
+            // Still over budget: let the commit worker in before
+            // the next round
+            pthread_mutex_unlock(&g->storage_consumed_lock);
+            backoff = g_gc_time_budget;
+            struct timespec pause = {0, g_gc_time_budget * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        } else if (g->storage_consumed > g->storage_budget) {
+            // Nothing left to delete: wait for the next commit, or
+            // retry a little later each time
+            wait = backoff;
+            if (backoff < g_gc_interval * 1000)
+                backoff *= 2;
+        } else {
+            backoff = g_gc_time_budget;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait / 1000;
+        deadline.tv_nsec += (wait % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        // main wakes GC up under the lock once g->stop is set
+        if (!g->stop)
+            pthread_cond_timedwait(&g->gc_cond, &g->storage_consumed_lock,
+                                   &deadline);
+        pthread_mutex_unlock(&g->storage_consumed_lock);
+    }
+
+    db_writer_close(&w);
+    return NULL;
+}
+
+// Account for newly committed data and wake up GC when over budget
+void gc_account(Global *g, int64_t size) {
+    pthread_mutex_lock(&g->storage_consumed_lock);
+    g->storage_consumed += size;
+    if (g->storage_consumed > g->storage_budget)
+        pthread_cond_signal(&g->gc_cond);
+    pthread_mutex_unlock(&g->storage_consumed_lock);
+}
+
+// Vacuum on startup: a full VACUUM without time limit (which also
+// switches an old database to incremental auto_vacuum), otherwise an
+// incremental vacuum running for at most `time_limit` seconds
+void gc_vacuum(const char *storage, uint32_t time_limit) {
+    sqlite3 *db = NULL;
+    db_open(&db, storage);
+
+    if (!time_limit) {
+        db_set_incremental_vacuum(db);
+        db_vacuum(db);
+    } else if (!db_is_incremental_vacuum(db)) {
+        WARN("gc: database is not in incremental auto_vacuum mode, run "
+             "--vacuum once without time limit to convert it");
+    } else {
+        double deadline = now() + time_limit;
+        while (db_get_freelist_size(db) > 0 && now() < deadline)
+            db_incremental_vacuum(db, g_gc_vacuum_pages);
+        if (db_get_freelist_size(db) > 0)
+            INFO("gc: vacuum time limit reached, %.2f MB left free",
+                 db_get_freelist_size(db) / 1024.0 / 1024.0);
+    }
+
+    db_close(db);
+}
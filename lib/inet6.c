@@ -0,0 +1,84 @@
+// IPv6 address table
+//
+// IPv6 destination addresses don't fit in an Entry, which would have to
+// grow by 12 bytes for every IPv4 entry.  Instead, each trunk has a
+// table of the distinct IPv6 addresses it holds, and IPv6 entries store
+// the index of their address in there as daddr.  Entries of a trunk
+// usually go to few destinations, so the table stays small.
+
+#include "inet6.h"
+#include <string.h>
+
+// `indexed` tables can be added to, the others are only filled by
+// copying addresses to t->addrs, see inet6_table_reserve.  The addresses
+// are stored in `addrs` if given, such as a staging file, else allocated.
+void inet6_table_init(Inet6Table *t, struct in6_addr *addrs,
+                      uint32_t capacity, bool indexed) {
+    memset(t, 0, sizeof(Inet6Table));
+    t->addrs = addrs ? addrs : malloc(sizeof(struct in6_addr) * capacity);
+    t->borrowed = addrs != NULL;
+    t->capacity = capacity;
+    if (indexed) {
+        uint32_t nr_slots = 16;
+        while (nr_slots < capacity * 2)
+            nr_slots <<= 1;
+        t->slots = calloc(nr_slots, sizeof(uint32_t));
+        t->mask = nr_slots - 1;
+    }
+}
+
+void inet6_table_destroy(Inet6Table *t) {
+    if (!t->borrowed)
+        free(t->addrs);
+    free(t->slots);
+    memset(t, 0, sizeof(Inet6Table));
+}
+
+void inet6_table_clear(Inet6Table *t) {
+    // Most trunks hold no IPv6 entry at all
+    if (t->size && t->slots)
+        memset(t->slots, 0, (t->mask + 1) * sizeof(uint32_t));
+    t->size = 0;
+}
+
+// Empty the table and make room for `capacity` addresses
+void inet6_table_reserve(Inet6Table *t, uint32_t capacity) {
+    if (capacity > t->capacity) {
+        assert(!t->borrowed);
+        free(t->addrs);
+        t->addrs = malloc(sizeof(struct in6_addr) * capacity);
+        t->capacity = capacity;
+    }
+    t->size = 0;
+}
+
+static uint32_t inet6_hash(const struct in6_addr *addr) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr->s6_addr, sizeof(hi));
+    memcpy(&lo, addr->s6_addr + 8, sizeof(lo));
+    uint64_t x = hi ^ (lo * 0x9e3779b97f4a7c15ULL);
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Return the index of `addr`, adding it if needed.  The table of a
+// trunk has room for one address per entry, so it can't be full.
+uint32_t inet6_table_add(Inet6Table *t, const struct in6_addr *addr) {
+    assert(t->slots && t->size < t->capacity);
+    uint32_t h = inet6_hash(addr) & t->mask;
+    while (t->slots[h]) {
+        uint32_t i = t->slots[h] - 1;
+        if (!memcmp(&t->addrs[i], addr, sizeof(struct in6_addr)))
+            return i;
+        h = (h + 1) & t->mask;
+    }
+
+    t->addrs[t->size] = *addr;
+    t->slots[h] = t->size + 1;
+    return t->size++;
+}
@@ -0,0 +1,415 @@
+#include "output.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Longest line of any text format
+#define OUTPUT_LINE_MAX 256
+
+void writer_init(Writer *w, int fd, size_t capacity) {
+    memset(w, 0, sizeof(Writer));
+    // localtime_r is not required to read the time zone by itself
+    tzset();
+    w->fd = fd;
+    w->buf = malloc(capacity);
+    w->capacity = capacity;
+}
+
+static void write_all(int fd, const char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            FATAL("Can't write output: %s", strerror(errno));
+        done += n;
+    }
+}
+
+void writer_flush(Writer *w) {
+    write_all(w->fd, w->buf, w->size);
+    w->size = 0;
+}
+
+void writer_destroy(Writer *w) {
+    writer_flush(w);
+    free(w->buf);
+}
+
+// Room for `size` more bytes, to be committed by advancing w->size
+char *writer_reserve(Writer *w, size_t size) {
+    if (w->size + size > w->capacity)
+        writer_flush(w);
+    return w->buf + w->size;
+}
+
+void writer_write(Writer *w, const void *data, size_t size) {
+    if (size > w->capacity) {
+        writer_flush(w);
+        write_all(w->fd, data, size);
+        return;
+    }
+    memcpy(writer_reserve(w, size), data, size);
+    w->size += size;
+}
+
+enum OutputFormat output_parse_format(const char *flag) {
+    if (!strcmp(flag, "text"))
+        return OUTPUT_TEXT;
+    if (!strcmp(flag, "csv"))
+        return OUTPUT_CSV;
+    if (!strcmp(flag, "json"))
+        return OUTPUT_JSON;
+    if (!strcmp(flag, "binary"))
+        return OUTPUT_BINARY;
+    FATAL("Unknown output format: %s", flag);
+}
+
+static const char *output_protocol(uint8_t protocol) {
+    return protocol == IPPROTO_TCP ? "TCP" : "UDP";
+}
+
+// Integers and addresses are rendered by hand, two digits at a time,
+// rather than through printf
+static const char digits2[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static char *format_u64(char *p, uint64_t v) {
+    char tmp[20], *q = tmp + sizeof(tmp);
+    while (v >= 100) {
+        q -= 2;
+        memcpy(q, digits2 + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        q -= 2;
+        memcpy(q, digits2 + v * 2, 2);
+    } else {
+        *--q = '0' + v;
+    }
+    memcpy(p, q, tmp + sizeof(tmp) - q);
+    return p + (tmp + sizeof(tmp) - q);
+}
+
+static char *format_i64(char *p, int64_t v) {
+    if (v < 0) {
+        *p++ = '-';
+        return format_u64(p, -(uint64_t)v);
+    }
+    return format_u64(p, v);
+}
+
+static char *format_str(char *p, const char *s, size_t len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+#define FORMAT_LITERAL(p, s) format_str((p), (s), sizeof(s) - 1)
+
+static char *format_ipv4(char *p, struct in_addr addr) {
+    const uint8_t *b = (const uint8_t *)&addr.s_addr;
+    p = format_u64(p, b[0]);
+    *p++ = '.';
+    p = format_u64(p, b[1]);
+    *p++ = '.';
+    p = format_u64(p, b[2]);
+    *p++ = '.';
+    return format_u64(p, b[3]);
+}
+
+// IPv6 addresses are rare enough to be left to inet_ntop
+static char *format_daddr(char *p, const State *s, const Entry *e) {
+    if (e->ip_version != 6)
+        return format_ipv4(p, e->daddr);
+    inet_ntop(AF_INET6, &s->daddrs6.addrs[e->daddr.s_addr], p,
+              INET6_ADDRSTRLEN);
+    return p + strlen(p);
+}
+
+// The text format starts with the local time of the entry.  It is only
+// computed once per minute, the seconds being patched in afterwards.
+static const char *format_timestamp(Writer *w, time_t t) {
+    if (!w->minute_set || t < w->minute || t >= w->minute + 60) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(w->timestamp, sizeof(w->timestamp), OUTPUT_DATE_FORMAT, &tm);
+        w->minute = t - tm.tm_sec;
+        w->minute_set = true;
+    }
+    memcpy(w->timestamp + 17, digits2 + (t - w->minute) * 2, 2);
+    return w->timestamp;
+}
+
+// Three digits, the milliseconds of a timestamp
+static char *format_msec(char *p, uint16_t msec) {
+    *p++ = '0' + msec / 100;
+    memcpy(p, digits2 + (msec % 100) * 2, 2);
+    return p + 2;
+}
+
+// Same as "  %s.%03u:\tdaddr=%-16s\tproto=%s\tuid=%d\tsport=%d\tdport=%d"
+//         "\tcount=%u\n"
+static char *format_text(Writer *w, const State *s, char *p,
+                         const Entry *e) {
+    p = FORMAT_LITERAL(p, "  ");
+    const char *timestamp = format_timestamp(w, e->timestamp);
+    p = format_str(p, timestamp, strlen(timestamp));
+    *p++ = '.';
+    p = format_msec(p, e->msec);
+    p = FORMAT_LITERAL(p, ":\tdaddr=");
+    char *addr = p;
+    p = format_daddr(p, s, e);
+    while (p - addr < 16)
+        *p++ = ' ';
+    p = FORMAT_LITERAL(p, "\tproto=");
+    p = format_str(p, output_protocol(e->protocol), 3);
+    p = FORMAT_LITERAL(p, "\tuid=");
+    p = format_i64(p, (int32_t)e->uid);
+    p = FORMAT_LITERAL(p, "\tsport=");
+    p = format_u64(p, e->sport);
+    p = FORMAT_LITERAL(p, "\tdport=");
+    p = format_u64(p, e->dport);
+    p = FORMAT_LITERAL(p, "\tcount=");
+    p = format_u64(p, e->count);
+    *p++ = '\n';
+    return p;
+}
+
+static char *format_csv(const State *s, char *p, const Entry *e) {
+    p = format_i64(p, e->timestamp);
+    *p++ = '.';
+    p = format_msec(p, e->msec);
+    *p++ = ',';
+    p = format_daddr(p, s, e);
+    *p++ = ',';
+    p = format_str(p, output_protocol(e->protocol), 3);
+    *p++ = ',';
+    p = format_u64(p, e->uid);
+    *p++ = ',';
+    p = format_u64(p, e->sport);
+    *p++ = ',';
+    p = format_u64(p, e->dport);
+    *p++ = ',';
+    p = format_u64(p, e->count);
+    *p++ = '\n';
+    return p;
+}
+
+static char *format_json(const State *s, char *p, const Entry *e) {
+    p = FORMAT_LITERAL(p, "{\"timestamp\":");
+    p = format_i64(p, e->timestamp);
+    *p++ = '.';
+    p = format_msec(p, e->msec);
+    p = FORMAT_LITERAL(p, ",\"daddr\":\"");
+    p = format_daddr(p, s, e);
+    p = FORMAT_LITERAL(p, "\",\"proto\":\"");
+    p = format_str(p, output_protocol(e->protocol), 3);
+    p = FORMAT_LITERAL(p, "\",\"uid\":");
+    p = format_u64(p, e->uid);
+    p = FORMAT_LITERAL(p, ",\"sport\":");
+    p = format_u64(p, e->sport);
+    p = FORMAT_LITERAL(p, ",\"dport\":");
+    p = format_u64(p, e->dport);
+    p = FORMAT_LITERAL(p, ",\"count\":");
+    p = format_u64(p, e->count);
+    p = FORMAT_LITERAL(p, "}\n");
+    return p;
+}
+
+void output_begin(Writer *w, enum OutputFormat format) {
+    switch (format) {
+    case OUTPUT_CSV:
+        writer_write(w, "timestamp,daddr,proto,uid,sport,dport,count\n", 44);
+        break;
+    case OUTPUT_BINARY: {
+        OutputHeader h = {.version = htole16(OUTPUT_BINARY_VERSION),
+                          .record_size = htole16(sizeof(OutputRecord))};
+        memcpy(h.magic, OUTPUT_BINARY_MAGIC, sizeof(h.magic));
+        writer_write(w, &h, sizeof(h));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void output_binary(Writer *w, const State *s, const uint32_t *sel,
+                          uint32_t nr_sel) {
+    for (uint32_t i = 0; i < nr_sel; ++i) {
+        const Entry *e = &s->store[sel[i]];
+        OutputRecord *r =
+            (OutputRecord *)writer_reserve(w, sizeof(OutputRecord));
+        memset(r, 0, sizeof(OutputRecord));
+        r->timestamp = htole64(e->timestamp);
+        if (e->ip_version == 6)
+            memcpy(r->daddr6, &s->daddrs6.addrs[e->daddr.s_addr],
+                   sizeof(r->daddr6));
+        else
+            memcpy(r->daddr, &e->daddr.s_addr, sizeof(r->daddr));
+        r->ip_version = e->ip_version;
+        r->uid = htole32(e->uid);
+        r->sport = htole16(e->sport);
+        r->dport = htole16(e->dport);
+        r->protocol = e->protocol;
+        r->msec = htole16(e->msec);
+        r->count = htole32(e->count);
+        w->size += sizeof(OutputRecord);
+    }
+}
+
+void output_entries(Writer *w, enum OutputFormat format, const State *s,
+                    const uint32_t *sel, uint32_t nr_sel) {
+    if (format == OUTPUT_BINARY) {
+        output_binary(w, s, sel, nr_sel);
+        return;
+    }
+
+    for (uint32_t i = 0; i < nr_sel; ++i) {
+        const Entry *e = &s->store[sel[i]];
+        char *line = writer_reserve(w, OUTPUT_LINE_MAX), *end = line;
+
+        switch (format) {
+        case OUTPUT_TEXT:
+            end = format_text(w, s, line, e);
+            break;
+        case OUTPUT_CSV:
+            end = format_csv(s, line, e);
+            break;
+        case OUTPUT_JSON:
+            end = format_json(s, line, e);
+            break;
+        default:
+            break;
+        }
+        w->size += end - line;
+    }
+}
+
+// Append one field of a group to the line
+static int output_field(char *line, enum OutputFormat format,
+                        const char *name, const char *value, bool quoted) {
+    switch (format) {
+    case OUTPUT_TEXT:
+        return sprintf(line, "\t%s=%s", name, value);
+    case OUTPUT_CSV:
+        return sprintf(line, ",%s", value);
+    default:
+        return sprintf(line, quoted ? ",\"%s\":\"%s\"" : ",\"%s\":%s", name,
+                       value);
+    }
+}
+
+static int output_group(char *line, enum OutputFormat format, uint32_t fields,
+                        const AggregateGroup *g) {
+    const AggregateKey *k = &g->key;
+    char value[INET6_ADDRSTRLEN];
+    int n;
+
+    if (format == OUTPUT_TEXT)
+        n = sprintf(line, "  count=%lu", g->count);
+    else if (format == OUTPUT_CSV)
+        n = sprintf(line, "%lu", g->count);
+    else
+        n = sprintf(line, "{\"count\":%lu", g->count);
+
+    if (fields & AGGREGATE_TIME) {
+        if (format == OUTPUT_TEXT)
+            strftime(value, 20, OUTPUT_DATE_FORMAT, localtime(&k->time));
+        else
+            sprintf(value, "%ld", (long)k->time);
+        n += output_field(line + n, format, "time", value, false);
+    }
+    if (fields & AGGREGATE_UID) {
+        sprintf(value, "%u", k->uid);
+        n += output_field(line + n, format, "uid", value, false);
+    }
+    if (fields & AGGREGATE_DADDR) {
+        // IPv4 addresses are shown as such rather than IPv4-mapped
+        if (k->ip_version == 4)
+            inet_ntop(AF_INET, &k->daddr.s6_addr[12], value, sizeof(value));
+        else
+            inet_ntop(AF_INET6, &k->daddr, value, sizeof(value));
+        n += output_field(line + n, format, "daddr", value, true);
+    }
+    if (fields & AGGREGATE_DPORT) {
+        sprintf(value, "%u", k->dport);
+        n += output_field(line + n, format, "dport", value, false);
+    }
+    if (fields & AGGREGATE_PROTOCOL)
+        n += output_field(line + n, format, "proto",
+                          output_protocol(k->protocol), true);
+
+    n += sprintf(line + n, format == OUTPUT_JSON ? "}\n" : "\n");
+    return n;
+}
+
+void output_groups(Writer *w, enum OutputFormat format, uint32_t fields,
+                   const AggregateGroup *groups, uint64_t nr_groups) {
+    if (format == OUTPUT_BINARY)
+        FATAL("Groups can't be written in binary format");
+
+    if (format == OUTPUT_CSV) {
+        char *line = writer_reserve(w, OUTPUT_LINE_MAX);
+        int n = sprintf(line, "count");
+        if (fields & AGGREGATE_TIME)
+            n += sprintf(line + n, ",time");
+        if (fields & AGGREGATE_UID)
+            n += sprintf(line + n, ",uid");
+        if (fields & AGGREGATE_DADDR)
+            n += sprintf(line + n, ",daddr");
+        if (fields & AGGREGATE_DPORT)
+            n += sprintf(line + n, ",dport");
+        if (fields & AGGREGATE_PROTOCOL)
+            n += sprintf(line + n, ",proto");
+        w->size += n + sprintf(line + n, "\n");
+    }
+
+    for (uint64_t i = 0; i < nr_groups; ++i) {
+        char *line = writer_reserve(w, OUTPUT_LINE_MAX);
+        w->size += output_group(line, format, fields, &groups[i]);
+    }
+}
+
+// Trunks missing packets, i.e. the time ranges where entries may be
+// missing as well
+void output_losses(Writer *w, enum OutputFormat format, const Header *headers,
+                   uint32_t nr_headers) {
+    if (format == OUTPUT_BINARY)
+        FATAL("Losses can't be written in binary format");
+
+    if (format == OUTPUT_CSV)
+        writer_write(w, "start_time,end_time,lost,overflows\n", 35);
+
+    for (uint32_t i = 0; i < nr_headers; ++i) {
+        const Header *h = &headers[i];
+        char *line = writer_reserve(w, OUTPUT_LINE_MAX);
+        char start[20], end[20];
+
+        switch (format) {
+        case OUTPUT_TEXT:
+            strftime(start, 20, OUTPUT_DATE_FORMAT, localtime(&h->start_time));
+            strftime(end, 20, OUTPUT_DATE_FORMAT, localtime(&h->end_time));
+            w->size += sprintf(line, "  %s - %s:\tlost=%u\toverflows=%u\n",
+                               start, end, h->nr_lost, h->nr_overflows);
+            break;
+        case OUTPUT_CSV:
+            w->size += sprintf(line, "%ld,%ld,%u,%u\n", (long)h->start_time,
+                               (long)h->end_time, h->nr_lost, h->nr_overflows);
+            break;
+        default:
+            w->size += sprintf(line,
+                               "{\"start_time\":%ld,\"end_time\":%ld,"
+                               "\"lost\":%u,\"overflows\":%u}\n",
+                               (long)h->start_time, (long)h->end_time,
+                               h->nr_lost, h->nr_overflows);
+            break;
+        }
+    }
+}
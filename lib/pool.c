@@ -0,0 +1,129 @@
+#include "pool.h"
+#include "collect.h"
+#include "main.h"
+#include "staging.h"
+#include <limits.h>
+#include <stdlib.h>
+
+void trunk_queue_init(TrunkQueue *q, uint32_t capacity) {
+    q->trunks = (State **)malloc(sizeof(State *) * capacity);
+    q->capacity = capacity;
+    q->head = q->size = 0;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+void trunk_queue_destroy(TrunkQueue *q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->trunks);
+}
+
+void trunk_queue_push(TrunkQueue *q, State *s) {
+    pthread_mutex_lock(&q->lock);
+    while (q->size == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->trunks[(q->head + q->size) % q->capacity] = s;
+    q->size++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// No more trunks will be pushed: wake up whoever waits for one
+void trunk_queue_close(TrunkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Pop a trunk, waiting until the deadline if the queue is empty, or
+// forever if the deadline is NULL, unless the queue is closed.  Return
+// NULL if nothing was popped.
+static State *_trunk_queue_pop(TrunkQueue *q, bool wait,
+                               const struct timespec *deadline) {
+    State *s = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (wait && q->size == 0 && !q->closed) {
+        if (!deadline)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        else if (pthread_cond_timedwait(&q->not_empty, &q->lock, deadline))
+            break;
+    }
+    if (q->size) {
+        s = q->trunks[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->size--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return s;
+}
+
+State *trunk_queue_pop(TrunkQueue *q) {
+    return _trunk_queue_pop(q, true, NULL);
+}
+
+State *trunk_queue_timed_pop(TrunkQueue *q, const struct timespec *deadline) {
+    return _trunk_queue_pop(q, true, deadline);
+}
+
+State *trunk_queue_try_pop(TrunkQueue *q) {
+    return _trunk_queue_pop(q, false, NULL);
+}
+
+uint32_t trunk_queue_size(TrunkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    uint32_t size = q->size;
+    pthread_mutex_unlock(&q->lock);
+    return size;
+}
+
+void trunk_pool_init(Global *g) {
+    // Every trunk is either free, being filled, queued or being
+    // committed, so neither queue can ever hold more than nr_trunks
+    trunk_queue_init(&g->free_trunks, g->nr_trunks);
+    trunk_queue_init(&g->commit_queue, g->nr_trunks);
+
+    g->trunks = (State **)malloc(sizeof(State *) * g->nr_trunks);
+    for (uint32_t i = 0; i < g->nr_trunks; ++i) {
+        char path[PATH_MAX];
+        if (g->staging)
+            staging_path(path, sizeof(path), g->storage_file, i);
+        state_init(&g->trunks[i], NULL, g, g->staging ? path : NULL);
+        trunk_queue_push(&g->free_trunks, g->trunks[i]);
+    }
+    g->nr_pool_stalls = 0;
+}
+
+void trunk_pool_destroy(Global *g) {
+    for (uint32_t i = 0; i < g->nr_trunks; ++i)
+        state_free(g->trunks[i]);
+    free(g->trunks);
+    trunk_queue_destroy(&g->commit_queue);
+    trunk_queue_destroy(&g->free_trunks);
+}
+
+State *trunk_pool_get(Global *g) {
+    State *s = trunk_queue_try_pop(&g->free_trunks);
+    if (likely(s != NULL))
+        return s;
+
+    // Pool depleted: all trunks are waiting for the commit worker.
+    // Stop receiving until one is recycled; the kernel queues (or
+    // drops) packets in the meantime.
+    uint64_t nr_stalls =
+        __atomic_add_fetch(&g->nr_pool_stalls, 1, __ATOMIC_RELAXED);
+    WARN("trunk pool depleted (%u trunks), waiting for commit "
+         "(%lu stalls so far)",
+         g->nr_trunks, (unsigned long)nr_stalls);
+    return trunk_queue_pop(&g->free_trunks);
+}
+
+void trunk_pool_put(State *s) {
+    state_reset(s);
+    trunk_queue_push(&s->global->free_trunks, s);
+}
@@ -1,7 +1,9 @@
 #include "sql.h"
 #include "collect.h"
 #include "extract.h"
+#include "synopsis.h"
 #include "util.h"
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -42,7 +44,11 @@ static inline int db_prepare(sqlite3 *db, const char *cmd, const char *errmsg,
 }
 
 int db_set_pragma(sqlite3 *db) {
+    // auto_vacuum only takes effect on a new database (or after a full
+    // VACUUM), and must be set before switching to WAL.  It lets GC give
+    // free pages back bit by bit instead of rewriting the whole database.
     return db_exec_fatal(db,
+                         "PRAGMA auto_vacuum=INCREMENTAL;"
                          "PRAGMA journal_mode=WAL;"
                          "PRAGMA foreign_keys=ON;",
                          "Can't set Sqlite3 PRAGMA");
@@ -52,6 +58,136 @@ int db_vacuum(sqlite3 *db) {
     return db_exec(db, "VACUUM", "Can't vacuum database");
 }
 
+int db_set_incremental_vacuum(sqlite3 *db) {
+    return db_exec(db, "PRAGMA auto_vacuum=INCREMENTAL",
+                   "Can't set auto_vacuum");
+}
+
+int db_set_mmap_size(sqlite3 *db, int64_t size) {
+    char sql[64];
+    sprintf(sql, "PRAGMA mmap_size=%" PRId64, size);
+    return db_exec(db, sql, "Can't map database in memory");
+}
+
+int db_incremental_vacuum(sqlite3 *db, uint32_t nr_pages) {
+    char sql[64];
+    sprintf(sql, "PRAGMA incremental_vacuum(%u)", nr_pages);
+    return db_exec(db, sql, "Can't incrementally vacuum database");
+}
+
+static int64_t db_pragma_int(sqlite3 *db, const char *pragma) {
+    sqlite3_stmt *stmt = NULL;
+    int64_t value = 0;
+    db_prepare(db, pragma, "Can't query pragma", &stmt);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+bool db_is_incremental_vacuum(sqlite3 *db) {
+    // 0: NONE, 1: FULL, 2: INCREMENTAL
+    return db_pragma_int(db, "PRAGMA auto_vacuum") == 2;
+}
+
+int64_t db_get_freelist_size(sqlite3 *db) {
+    return db_pragma_int(db, "PRAGMA freelist_count") *
+           db_pragma_int(db, "PRAGMA page_size");
+}
+
+// Take the write lock up front, so that a transaction which reads before
+// writing waits for the other writer instead of failing with SQLITE_BUSY
+int db_begin(sqlite3 *db) {
+    return db_exec_fatal(db, "BEGIN IMMEDIATE TRANSACTION",
+                         "db_begin: Can't begin txn");
+}
+
+int db_end(sqlite3 *db) {
+    return db_exec_fatal(db, "END TRANSACTION", "db_end: Can't end txn");
+}
+
+int db_rollback(sqlite3 *db) {
+    return db_exec(db, "ROLLBACK TRANSACTION",
+                   "db_rollback: Can't roll back txn");
+}
+
+// Columns added to the header table after it was first released.  They
+// are appended to existing databases on open, so each needs a default
+// value describing the rows written before it existed.
+static const char *const header_columns[][2] = {
+    {"format", "INTEGER NOT NULL DEFAULT 0"},
+    {"dict_id", "INTEGER NOT NULL DEFAULT 0"},
+    {"compression_level", "INTEGER NOT NULL DEFAULT 0"},
+    {"synopsis", "BLOB DEFAULT NULL"},
+    {"nr_lost", "INTEGER NOT NULL DEFAULT 0"},
+    {"nr_overflows", "INTEGER NOT NULL DEFAULT 0"},
+};
+
+static bool db_has_column(sqlite3 *db, const char *table, const char *column) {
+    sqlite3_stmt *stmt = NULL;
+    bool found = false;
+    char sql[128];
+    snprintf(sql, sizeof(sql), "PRAGMA table_info(%s)", table);
+    db_prepare(db, sql, "Can't query table info", &stmt);
+    while (!found && sqlite3_step(stmt) == SQLITE_ROW)
+        found = !strcmp((const char *)sqlite3_column_text(stmt, 1), column);
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+// Version of the schema, kept in the user_version of the database.  To be
+// increased along with header_columns.  Version 2 deletes the headers of
+// the trunks recycled by earlier versions, which were left behind.
+#define DB_SCHEMA_VERSION 2
+
+static int db_get_user_version(sqlite3 *db) {
+    sqlite3_stmt *stmt = NULL;
+    int version = 0;
+    db_prepare(db, "PRAGMA user_version", "Can't query user_version", &stmt);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Whether the database has every column, databases migrated before
+// user_version was set included
+static bool db_is_current(sqlite3 *db) {
+    if (db_get_user_version(db) >= DB_SCHEMA_VERSION)
+        return true;
+    for (size_t i = 0; i < sizeof(header_columns) / sizeof(*header_columns);
+         ++i)
+        if (!db_has_column(db, g_sqlite_table_header, header_columns[i][0]))
+            return false;
+    return true;
+}
+
+static void db_migrate(sqlite3 *db) {
+    if (db_get_user_version(db) >= DB_SCHEMA_VERSION)
+        return;
+    db_begin(db);
+    for (size_t i = 0; i < sizeof(header_columns) / sizeof(*header_columns);
+         ++i) {
+        const char *column = header_columns[i][0];
+        if (db_has_column(db, g_sqlite_table_header, column))
+            continue;
+
+        char sql[256];
+        snprintf(sql, sizeof(sql), "ALTER TABLE " g_sqlite_table_header
+                 " ADD COLUMN %s %s", column, header_columns[i][1]);
+        DEBUG("sqlite3: adding column %s to " g_sqlite_table_header, column);
+        db_exec_fatal(db, sql, "Can't add column");
+    }
+    db_exec_fatal(db,
+                  "DELETE FROM " g_sqlite_table_header
+                  " WHERE data_id IS NULL",
+                  "Can't delete headers of recycled trunks");
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA user_version=%d", DB_SCHEMA_VERSION);
+    db_exec_fatal(db, sql, "Can't set user_version");
+    db_end(db);
+}
+
 int db_create_table(sqlite3 *db) {
     const char *create_sql =
         "CREATE TABLE IF NOT EXISTS " g_sqlite_table_data " ("
@@ -68,12 +204,31 @@ int db_create_table(sqlite3 *db) {
         "data_id INTEGER,"
         "FOREIGN KEY(data_id) REFERENCES " g_sqlite_table_data
         "(id) ON DELETE SET NULL"
+        ");"
+        // Trunks still holding data, ordered by time, for both
+        // time range queries and GC
+        "CREATE INDEX IF NOT EXISTS " g_sqlite_index_time
+        " ON " g_sqlite_table_header " (end_time, start_time)"
+        " WHERE data_id IS NOT NULL;"
+        // Longest trunk, to bound the end time of the trunks overlapping
+        // a time range from above
+        "CREATE INDEX IF NOT EXISTS " g_sqlite_index_span
+        " ON " g_sqlite_table_header " (end_time - start_time)"
+        " WHERE data_id IS NOT NULL;"
+        // Header of a trunk, for the foreign key when GC deletes its data
+        "CREATE INDEX IF NOT EXISTS " g_sqlite_index_data
+        " ON " g_sqlite_table_header " (data_id);"
+        "CREATE TABLE IF NOT EXISTS " g_sqlite_table_dict " ("
+        "id INTEGER PRIMARY KEY,"
+        "data BLOB"
         ");";
     int rc = 0, retry = g_sqlite_nr_fail_retry;
     while (retry--) {
         rc = db_exec(db, create_sql, "Can't create table");
-        if (SQLITE_LOCKED != rc && SQLITE_BUSY != rc)
+        if (SQLITE_LOCKED != rc && SQLITE_BUSY != rc) {
+            db_migrate(db);
             return rc;
+        }
         sleep(1);
     }
 
@@ -90,189 +245,367 @@ int db_open(sqlite3 **db, const char *dbname) {
         exit(1);
     }
 
+    // Several commit threads may write to the same database
+    sqlite3_busy_timeout(*db, g_sqlite_busy_timeout);
     return db_set_pragma(*db);
 }
 
+// Open the database for reading only, so that users and files without
+// write access can extract.  Databases written by older versions are
+// brought up to date first, which does need write access.
+int db_open_reader(sqlite3 **db, const char *dbname) {
+    int rc = sqlite3_open_v2(dbname, db, SQLITE_OPEN_READONLY, NULL);
+    if (SQLITE_OK != rc) {
+        ERROR("Can't open database %s (%i): %s\n", dbname, rc,
+              sqlite3_errmsg(*db));
+        exit(1);
+    }
+    sqlite3_busy_timeout(*db, g_sqlite_busy_timeout);
+    if (db_is_current(*db))
+        return SQLITE_OK;
+
+    sqlite3_close(*db);
+    db_open(db, dbname);
+    return db_create_table(*db);
+}
+
 int db_close(sqlite3 *db) {
     sqlite3_close(db);
     return 0;
 }
 
-int db_insert(sqlite3 *db, const Header *header, const Entry *entries) {
-    int rc;
-    sqlite3_stmt *stmt[2] = {0};
-    const char *insert_sql[] = {
-        "INSERT INTO " g_sqlite_table_data " (data) VALUES(?)",
+int db_writer_open(DBWriter *w, const char *dbname) {
+    const char *insert_data_sql =
+        "INSERT INTO " g_sqlite_table_data " (data) VALUES(?)";
+    const char *insert_header_sql =
         "INSERT INTO " g_sqlite_table_header " "
-        "(nr_entries, size, compression_type, start_time, end_time, data_id) "
-        "VALUES(?, ?, ?, ?, ?, ?)"};
-
-    db_exec_fatal(db, "BEGIN TRANSACTION", "db_insert: Can't begin txn");
-    for (int i = 0; i < 2;) {
-        rc = db_prepare(db, insert_sql[i], "Can't insert data", &stmt[i]);
-        if (i == 0) {
-            sqlite3_bind_blob(stmt[i], 1, entries, header->raw_size,
-                              SQLITE_STATIC);
-        } else {
-            sqlite3_int64 data_id = sqlite3_last_insert_rowid(db);
-            sqlite3_bind_int(stmt[i], 1, header->nr_entries);
-            sqlite3_bind_int(stmt[i], 2, header->raw_size);
-            sqlite3_bind_int(stmt[i], 3, header->compression_type);
-            sqlite3_bind_int64(stmt[i], 4, header->start_time);
-            sqlite3_bind_int64(stmt[i], 5, header->end_time);
-            sqlite3_bind_int64(stmt[i], 6, data_id);
-        }
+        "(nr_entries, size, compression_type, start_time, end_time, data_id, "
+        "format, dict_id, compression_level, synopsis, nr_lost, "
+        "nr_overflows) "
+        "VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    const char *select_oldest_sql =
+        "SELECT size, end_time, data_id, id "
+        "FROM " g_sqlite_table_header " WHERE data_id IS NOT NULL "
+        "ORDER BY end_time LIMIT ?";
+    const char *delete_header_sql =
+        "DELETE FROM " g_sqlite_table_header " WHERE id = ?";
+    const char *delete_data_sql =
+        "DELETE FROM " g_sqlite_table_data " WHERE id = ?";
+    const char *insert_dict_sql =
+        "INSERT INTO " g_sqlite_table_dict " (data) VALUES(?)";
+
+    memset(w, 0, sizeof(DBWriter));
+    db_open(&w->db, dbname);
+    db_create_table(w->db);
+
+    // Statements are prepared once and reused by every commit
+    db_prepare(w->db, insert_data_sql, "Can't prepare insert",
+               &w->insert_data);
+    db_prepare(w->db, insert_header_sql, "Can't prepare insert",
+               &w->insert_header);
+    db_prepare(w->db, select_oldest_sql, "Can't prepare select",
+               &w->select_oldest);
+    db_prepare(w->db, delete_header_sql, "Can't prepare delete",
+               &w->delete_header);
+    db_prepare(w->db, delete_data_sql, "Can't prepare delete",
+               &w->delete_data);
+    db_prepare(w->db, insert_dict_sql, "Can't prepare insert",
+               &w->insert_dict);
+    return SQLITE_OK;
+}
 
-        rc = sqlite3_step(stmt[i]);
-        if (rc != SQLITE_DONE)
-            WARN("sqlite3: Insert data step fail: %d\n", rc);
+int db_writer_close(DBWriter *w) {
+    sqlite3_finalize(w->insert_data);
+    sqlite3_finalize(w->insert_header);
+    sqlite3_finalize(w->select_oldest);
+    sqlite3_finalize(w->delete_header);
+    sqlite3_finalize(w->delete_data);
+    sqlite3_finalize(w->insert_dict);
+    db_close(w->db);
+    memset(w, 0, sizeof(DBWriter));
+    return 0;
+}
 
-        if (SQLITE_SCHEMA == sqlite3_finalize(stmt[i]))
-            continue;
-        i++;
+static inline int db_step_reset(sqlite3_stmt *stmt, const char *errmsg) {
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+        WARN("sqlite3: %s step fail: %d", errmsg, rc);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+int db_insert(DBWriter *w, const Header *header, const void *data) {
+    int rc;
+    // Join the caller's transaction if there is one, e.g. when
+    // several trunks are committed together
+    bool own_txn = sqlite3_get_autocommit(w->db);
+    if (own_txn)
+        db_begin(w->db);
+
+    sqlite3_bind_blob(w->insert_data, 1, data, header->raw_size,
+                      SQLITE_STATIC);
+    rc = db_step_reset(w->insert_data, "Insert data");
+
+    if (rc == SQLITE_DONE) {
+        sqlite3_int64 data_id = sqlite3_last_insert_rowid(w->db);
+        sqlite3_bind_int(w->insert_header, 1, header->nr_entries);
+        sqlite3_bind_int(w->insert_header, 2, header->raw_size);
+        sqlite3_bind_int(w->insert_header, 3, header->compression_type);
+        sqlite3_bind_int64(w->insert_header, 4, header->start_time);
+        sqlite3_bind_int64(w->insert_header, 5, header->end_time);
+        sqlite3_bind_int64(w->insert_header, 6, data_id);
+        sqlite3_bind_int(w->insert_header, 7, header->format);
+        sqlite3_bind_int64(w->insert_header, 8, header->dict_id);
+        sqlite3_bind_int(w->insert_header, 9, header->compression_level);
+        if (header->has_synopsis)
+            sqlite3_bind_blob(w->insert_header, 10, &header->synopsis,
+                              sizeof(Synopsis), SQLITE_STATIC);
+        else
+            sqlite3_bind_null(w->insert_header, 10);
+        sqlite3_bind_int64(w->insert_header, 11, header->nr_lost);
+        sqlite3_bind_int64(w->insert_header, 12, header->nr_overflows);
+        rc = db_step_reset(w->insert_header, "Insert header");
     }
 
     DEBUG("Inserted #%d of compressed size %d", header->nr_entries,
           header->raw_size);
-    db_exec_fatal(db, "END TRANSACTION", "db_insert: Can't end txn");
+    if (own_txn)
+        db_end(w->db);
     return rc;
 }
 
-int db_read_data_by_timerange(sqlite3 *db, const Timerange *t,
-                              StateCallback cb) {
-    const char *_select_sql =
-        "SELECT * FROM " g_sqlite_table_header
-        " INNER JOIN " g_sqlite_table_data " ON " g_sqlite_table_header
-        ".data_id = " g_sqlite_table_data ".id"
-        " WHERE " g_sqlite_table_header
-        ".end_time > %ld AND " g_sqlite_table_header ".start_time < %ld";
-    char select_sql[strlen(_select_sql) + 25];
-    sprintf(select_sql, _select_sql, t->from, t->until);
+// Store a zstd dictionary, returning its id or 0 on failure
+uint32_t db_insert_dict(DBWriter *w, const void *dict, size_t size) {
+    sqlite3_bind_blob(w->insert_dict, 1, dict, size, SQLITE_STATIC);
+    if (db_step_reset(w->insert_dict, "Insert dictionary") != SQLITE_DONE)
+        return 0;
+    return sqlite3_last_insert_rowid(w->db);
+}
+
+// Delete dictionaries no trunk is compressed with any more, except
+// the latest one which is still in use by the commit worker
+int db_delete_unused_dicts(DBWriter *w) {
+    return db_exec(w->db,
+                   "DELETE FROM " g_sqlite_table_dict
+                   " WHERE id < (SELECT MAX(id) FROM " g_sqlite_table_dict ")"
+                   " AND id NOT IN (SELECT dict_id FROM " g_sqlite_table_header
+                   " WHERE data_id IS NOT NULL)",
+                   "Can't delete dictionaries");
+}
 
+int db_read_dicts(sqlite3 *db, ExtractContext *ctx) {
     sqlite3_stmt *stmt;
-    db_exec_fatal(db, "BEGIN TRANSACTION", "db_delete: Can't begin txn");
-    int rc = sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        ERROR("Can't select (%i): %s\n", rc, sqlite3_errmsg(db));
-        sqlite3_close(db);
-        exit(1);
+    int count = 0;
+    db_prepare(db, "SELECT id, data FROM " g_sqlite_table_dict,
+               "Can't select dictionaries", &stmt);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        extract_add_dict(ctx, sqlite3_column_int64(stmt, 0),
+                         sqlite3_column_blob(stmt, 1),
+                         sqlite3_column_bytes(stmt, 1));
+        count++;
     }
+    sqlite3_finalize(stmt);
+    return count;
+}
 
-    int count = 0;
-    for (;; count++) {
-        rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE)
-            break;
-        assert(rc == SQLITE_ROW);
+// Trunks overlapping the time range [?1, ?2).  A trunk starting before
+// ?2 ends before ?2 plus the longest trunk span, which bounds the scan of
+// the time index from above.
+#define TIMERANGE_WHERE(h)                                                     \
+    h "end_time >= ?1 AND " h "start_time < ?2 AND " h "end_time < ?2 + "      \
+      "(SELECT max(end_time - start_time) FROM " g_sqlite_table_header         \
+      " WHERE data_id IS NOT NULL)"
+
+// Trunks are extracted and filtered by `nr_workers` threads, while the
+// callback is run on the calling thread in the order of the query.
+// Trunk data is copied once, by sqlite3_blob_read, into a buffer of the
+// pool reused from one trunk to the next.  The database is mapped in
+// memory so that the copy is made from the page cache rather than read.
+int db_read_data_by_timerange(sqlite3 *db, const Timerange *t,
+                              const Filter *f, StateCallback cb,
+                              uint32_t nr_workers) {
+    // Served by the partial time index on the header table
+    const char *select_sql =
+        "SELECT h.nr_entries, h.size, h.compression_type, h.start_time, "
+        "h.end_time, h.format, h.dict_id, h.compression_level, h.synopsis, "
+        "h.data_id, h.nr_lost, h.nr_overflows "
+        "FROM " g_sqlite_table_header " AS h "
+        "WHERE h.data_id IS NOT NULL AND " TIMERANGE_WHERE("h.") " "
+        "ORDER BY h.end_time";
+
+    sqlite3_stmt *stmt;
+    sqlite3_blob *blob = NULL;
+    ExtractContext dicts;
+    ExtractPool pool;
+    db_set_mmap_size(db, g_sqlite_mmap_size);
+    extract_init(&dicts);
+    db_exec_fatal(db, "BEGIN TRANSACTION", "db_read: Can't begin txn");
+    db_read_dicts(db, &dicts);
+    extract_pool_init(&pool, nr_workers, &dicts, t, f);
+    db_prepare(db, select_sql, "Can't select", &stmt);
+    // Trunk times are in seconds, round the range outwards
+    sqlite3_bind_int64(stmt, 1, t->from / 1000);
+    sqlite3_bind_int64(stmt, 2, (t->until + 999) / 1000);
+
+    int rc = SQLITE_ROW, count = 0, skipped = 0;
+    while (rc != SQLITE_DONE || !extract_pool_empty(&pool)) {
+        // Keep the workers busy, then hand the oldest trunk over
+        while (rc != SQLITE_DONE && !extract_pool_full(&pool)) {
+            rc = sqlite3_step(stmt);
+            if (rc == SQLITE_DONE)
+                break;
+            assert(rc == SQLITE_ROW);
+            count++;
+
+            ExtractJob *job = extract_pool_reserve(&pool);
+            Header *h = job->s.header;
+            h->nr_entries = sqlite3_column_int(stmt, 0);
+            h->raw_size = sqlite3_column_int(stmt, 1);
+            h->compression_type = sqlite3_column_int(stmt, 2);
+            h->start_time = sqlite3_column_int64(stmt, 3);
+            h->end_time = sqlite3_column_int64(stmt, 4);
+            h->format = sqlite3_column_int(stmt, 5);
+            h->dict_id = sqlite3_column_int64(stmt, 6);
+            h->compression_level = sqlite3_column_int(stmt, 7);
+            h->has_synopsis =
+                sqlite3_column_bytes(stmt, 8) == sizeof(Synopsis);
+            if (h->has_synopsis)
+                memcpy(&h->synopsis, sqlite3_column_blob(stmt, 8),
+                       sizeof(Synopsis));
+            sqlite3_int64 data_id = sqlite3_column_int64(stmt, 9);
+            h->nr_lost = sqlite3_column_int64(stmt, 10);
+            h->nr_overflows = sqlite3_column_int64(stmt, 11);
+
+            // Skip trunks without any match, or only holding losses,
+            // before reading them
+            if (!h->nr_entries || !synopsis_may_match(h, f)) {
+                skipped++;
+                continue;
+            }
+
+            // One blob handle is moved from trunk to trunk
+            rc = blob ? sqlite3_blob_reopen(blob, data_id)
+                      : sqlite3_blob_open(db, "main", g_sqlite_table_data,
+                                          "data", data_id, 0, &blob);
+            if (rc != SQLITE_OK)
+                FATAL("extract: can't open trunk #%lld: %s",
+                      (long long)data_id, sqlite3_errmsg(db));
+            rc = SQLITE_ROW;
+
+            size_t size = sqlite3_blob_bytes(blob);
+            DEBUG("extract: nr_entries: %d "
+                  "raw_size: %d "
+                  "compression_type: %d "
+                  "size: %ld",
+                  h->nr_entries, h->raw_size, h->compression_type, size);
+            if (size != (size_t)h->raw_size)
+                FATAL("extract: header data size and actual size not match: "
+                      "expected: %u, got: %ld",
+                      h->raw_size, size);
+
+            // Workers outlive the blob handle, which is moved on to the
+            // next trunk, so they extract from a copy
+            if (sqlite3_blob_read(blob, extract_job_buffer(job, size), size,
+                                  0) != SQLITE_OK)
+                FATAL("extract: can't read trunk #%lld: %s",
+                      (long long)data_id, sqlite3_errmsg(db));
+            extract_pool_submit(&pool);
+        }
 
-        State *s = malloc(sizeof(State));
-        s->header = malloc(sizeof(Header));
-        s->header->nr_entries = sqlite3_column_int(stmt, 1);
-        s->header->raw_size = sqlite3_column_int(stmt, 2);
-        s->header->compression_type = sqlite3_column_int(stmt, 3);
-
-        size_t size = sqlite3_column_bytes(stmt, 8);
-        DEBUG("extract: nr_entries: %d "
-              "raw_size: %d "
-              "compression_type: %d "
-              "size: %ld",
-              s->header->nr_entries, s->header->raw_size,
-              s->header->compression_type, size);
-        if (size != (size_t)s->header->raw_size)
-            FATAL("extract: header data size and actual size not match: "
-                  "expected: %u, got: %ld",
-                  s->header->raw_size, size);
-
-        bool ok = extract(s, sqlite3_column_blob(stmt, 8));
-        if (ok)
-            cb(s, t);
-        state_free(s);
+        if (!extract_pool_empty(&pool)) {
+            ExtractJob *job = extract_pool_next(&pool);
+            if (job->ok && job->nr_sel)
+                cb(&job->s, job->sel, job->nr_sel);
+        }
     }
 
+    DEBUG("extract: %d trunks in range, %d skipped by their synopsis", count,
+          skipped);
+    sqlite3_blob_close(blob);
     assert(SQLITE_SCHEMA != sqlite3_finalize(stmt));
-    db_exec_fatal(db, "END TRANSACTION", "db_begin: Can't end txn");
+    db_exec_fatal(db, "END TRANSACTION", "db_read: Can't end txn");
+    extract_pool_destroy(&pool);
+    extract_destroy(&dicts);
 
     return count;
 }
 
-int db_get_space_consumed(sqlite3 *db) {
-    const char *select_data_sql = "SELECT SUM(size) FROM " g_sqlite_table_data;
-    const char *select_header_sql =
-        "SELECT COUNT(*) FROM " g_sqlite_table_header;
-
-    int size;
-    sqlite3_stmt *stmt = NULL;
-    db_prepare(db, select_data_sql, "Can't query data", &stmt);
-    size = sqlite3_column_int64(stmt, 1);
+// Headers of the trunks within the time range known to miss packets,
+// oldest first, in a buffer to be freed by the caller.  Return their
+// number.
+uint32_t db_read_losses(sqlite3 *db, const Timerange *t, Header **headers) {
+    const char *select_sql =
+        "SELECT start_time, end_time, nr_lost, nr_overflows "
+        "FROM " g_sqlite_table_header " "
+        "WHERE data_id IS NOT NULL AND " TIMERANGE_WHERE("") " "
+        "AND (nr_lost > 0 OR nr_overflows > 0) "
+        "ORDER BY end_time";
+    sqlite3_stmt *stmt;
+    uint32_t n = 0, capacity = 16;
+
+    *headers = malloc(sizeof(Header) * capacity);
+    db_prepare(db, select_sql, "Can't select", &stmt);
+    sqlite3_bind_int64(stmt, 1, t->from / 1000);
+    sqlite3_bind_int64(stmt, 2, (t->until + 999) / 1000);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (n == capacity) {
+            capacity *= 2;
+            *headers = realloc(*headers, sizeof(Header) * capacity);
+        }
+        Header *h = &(*headers)[n++];
+        memset(h, 0, sizeof(Header));
+        h->start_time = sqlite3_column_int64(stmt, 0);
+        h->end_time = sqlite3_column_int64(stmt, 1);
+        h->nr_lost = sqlite3_column_int64(stmt, 2);
+        h->nr_overflows = sqlite3_column_int64(stmt, 3);
+    }
+    sqlite3_finalize(stmt);
+    return n;
+}
 
-    db_prepare(db, select_header_sql, "Can't query data", &stmt);
-    size += sizeof(Header) * sqlite3_column_int64(stmt, 1);
-    return size;
+// Space taken by live data, excluding free pages waiting to be reused
+int64_t db_get_space_consumed(sqlite3 *db) {
+    return (db_pragma_int(db, "PRAGMA page_count") -
+            db_pragma_int(db, "PRAGMA freelist_count")) *
+           db_pragma_int(db, "PRAGMA page_size");
 }
 
-int db_delete_oldest_bytes(sqlite3 *db, int64_t bytes) {
+// Delete at most `max_count` of the oldest trunks, header and data,
+// stopping as soon as `bytes` bytes are freed.  Return the number of
+// trunks deleted.
+int db_delete_oldest_bytes(DBWriter *w, int64_t bytes, uint32_t max_count) {
     int rc;
-    sqlite3_stmt *stmt;
-    const char *select_sql =
-        "SELECT size, end_time, data_id "
-        "FROM " g_sqlite_table_header " WHERE data_id IS NOT NULL "
-        "ORDER BY end_time";
-    if (!bytes)
+    if (bytes <= 0)
         return 0;
 
-    db_exec_fatal(db, "BEGIN TRANSACTION",
-                  "db_delete_oldest_byte: Can't begin txn");
-    rc = sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        ERROR("Can't select (%i): %s\n", rc, sqlite3_errmsg(db));
-        sqlite3_close(db);
-        exit(1);
-    }
+    db_begin(w->db);
 
     int count = 0;
-    size_t bufsize = 1024;
-    char *buf = malloc(bufsize);
-
-    while (true) {
-        rc = sqlite3_step(stmt);
+    sqlite3_int64 ids[max_count], header_ids[max_count];
+    sqlite3_bind_int(w->select_oldest, 1, max_count);
+    while (bytes > 0) {
+        rc = sqlite3_step(w->select_oldest);
         if (rc == SQLITE_DONE)
             break;
         assert(rc == SQLITE_ROW);
-        sqlite3_int64 index = sqlite3_column_int64(stmt, 2);
-        int size = sqlite3_column_int(stmt, 0);
-
-        bytes -= size;
-        if (bytes <= 0)
-            break;
-
-        char _buf[22];
-        sprintf(_buf, count ? ",%lld" : "%lld", index);
-        while (strlen(_buf) + strlen(buf) + 2 >= bufsize) {
-            bufsize *= 2;
-            char *__buf = malloc(bufsize);
-            memcpy(__buf, buf, strlen(buf) + 1);
-            free(buf);
-            buf = __buf;
-        }
-
-        strcat(buf, _buf);
-        count++;
+        ids[count] = sqlite3_column_int64(w->select_oldest, 2);
+        header_ids[count++] = sqlite3_column_int64(w->select_oldest, 3);
+        bytes -= sqlite3_column_int(w->select_oldest, 0) + g_header_row_size;
     }
-
-    if (count) {
-        const char *_delete_sql =
-            "DELETE FROM " g_sqlite_table_data " WHERE id in (%s);";
-        char *delete_sql = malloc(strlen(_delete_sql) + strlen(buf) + 1);
-        sprintf(delete_sql, _delete_sql, buf);
-        db_exec_fatal(db, delete_sql, "Can't delete");
-        DEBUG("Deleted old data, SQL: %s", delete_sql);
-        free(delete_sql);
+    sqlite3_reset(w->select_oldest);
+
+    // Delete after the select is done, as modifying the tables
+    // while stepping through them is undefined behavior
+    for (int i = 0; i < count; ++i) {
+        sqlite3_bind_int64(w->delete_header, 1, header_ids[i]);
+        db_step_reset(w->delete_header, "Delete header");
+        sqlite3_bind_int64(w->delete_data, 1, ids[i]);
+        db_step_reset(w->delete_data, "Delete data");
     }
 
-    free(buf);
-    assert(SQLITE_SCHEMA != sqlite3_finalize(stmt));
-    db_exec_fatal(db, "END TRANSACTION",
-                  "db_delete_oldest_byte: Can't end txn");
+    DEBUG("Deleted %d old data", count);
+    db_end(w->db);
 
     return count;
 }
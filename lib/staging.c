@@ -0,0 +1,237 @@
+// Staging files
+//
+// The trunks being filled live in files mapped in memory rather than on
+// the heap, so that their entries outlive a crash of nfcollect: the
+// pages are written back by the kernel either way.  Each preallocated
+// trunk has its own file next to the database, "<storage>-trunk<id>":
+//
+//   StagingPrefix
+//   Header
+//   Entry store[max_nr_entries]
+//   struct in6_addr daddrs6[max_nr_entries]
+//
+// each part starting on a STAGING_ALIGN boundary.  Entries are written
+// before nr_entries is increased, so the entries counted are complete,
+// and nr_entries is cleared as soon as the trunk is committed.  Trunks
+// left with entries are committed on the next startup by
+// staging_recover.  Only that clearing is synced, the entries don't
+// survive a power loss.
+
+#include "staging.h"
+#include "commit.h"
+#include "gc.h"
+#include "inet6.h"
+#include "sql.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STAGING_MAGIC "NFCS"
+#define STAGING_VERSION 1
+#define STAGING_ALIGN 64
+#define STAGING_ALIGN_UP(n)                                                    \
+    (((n) + STAGING_ALIGN - 1) / STAGING_ALIGN * STAGING_ALIGN)
+
+typedef struct _StagingPrefix {
+    char magic[4];
+    uint32_t version;
+    // Layout of the rest of the file
+    uint32_t header_size;
+    uint32_t max_nr_entries;
+} StagingPrefix;
+
+#define STAGING_HEADER_OFFSET STAGING_ALIGN_UP(sizeof(StagingPrefix))
+#define STAGING_STORE_OFFSET                                                   \
+    (STAGING_HEADER_OFFSET + STAGING_ALIGN_UP(sizeof(Header)))
+
+static size_t daddrs6_offset(uint32_t max_nr_entries) {
+    return STAGING_STORE_OFFSET +
+           STAGING_ALIGN_UP((size_t)max_nr_entries * sizeof(Entry));
+}
+
+static size_t staging_size(uint32_t max_nr_entries) {
+    return daddrs6_offset(max_nr_entries) +
+           (size_t)max_nr_entries * sizeof(struct in6_addr);
+}
+
+void staging_path(char *path, size_t size, const char *storage, uint32_t id) {
+    snprintf(path, size, "%s-trunk%u", storage, id);
+}
+
+// Point the trunk at the mapping.  Only trunks being filled need their
+// IPv6 address table indexed.
+static void staging_attach(State *s, void *map, size_t size,
+                           uint32_t max_nr_entries, bool indexed) {
+    s->staging = map;
+    s->staging_size = size;
+    s->header = (Header *)((char *)map + STAGING_HEADER_OFFSET);
+    s->store = (Entry *)((char *)map + STAGING_STORE_OFFSET);
+    inet6_table_init(
+        &s->daddrs6,
+        (struct in6_addr *)((char *)map + daddrs6_offset(max_nr_entries)),
+        max_nr_entries, indexed);
+}
+
+// Map an empty staging file for the trunk, in place of heap memory.
+// Whatever the file held is discarded, see staging_recover.
+void staging_open(State *s, const char *path) {
+    uint32_t max_nr_entries = s->global->max_nr_entries;
+    size_t size = staging_size(max_nr_entries);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+        FATAL("Can't create staging file %s: %s", path, strerror(errno));
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        FATAL("Can't map staging file %s: %s", path, strerror(errno));
+    close(fd);
+
+    StagingPrefix *prefix = (StagingPrefix *)map;
+    memcpy(prefix->magic, STAGING_MAGIC, sizeof(prefix->magic));
+    prefix->version = STAGING_VERSION;
+    prefix->header_size = sizeof(Header);
+    prefix->max_nr_entries = max_nr_entries;
+    staging_attach(s, map, size, max_nr_entries, true);
+}
+
+void staging_close(State *s) {
+    inet6_table_destroy(&s->daddrs6);
+    munmap(s->staging, s->staging_size);
+    s->staging = NULL;
+    s->header = NULL;
+    s->store = NULL;
+}
+
+// Mark the trunk committed, right after the transaction committing it,
+// so that it is not recovered again.  The header is flushed at once:
+// entries written back earlier must not be recovered after a power
+// loss either.
+void staging_committed(State *s) {
+    __atomic_store_n(&s->header->nr_entries, 0, __ATOMIC_RELEASE);
+    if (msync(s->staging, STAGING_STORE_OFFSET, MS_SYNC) < 0)
+        WARN("staging: can't sync staging file: %s", strerror(errno));
+}
+
+// Map a staging file left by a previous run, if it is sound
+static bool staging_load(State *s, int fd, const char *path) {
+    struct stat st;
+    StagingPrefix prefix;
+    if (fstat(fd, &st) < 0 ||
+        pread(fd, &prefix, sizeof(prefix), 0) != sizeof(prefix) ||
+        memcmp(prefix.magic, STAGING_MAGIC, sizeof(prefix.magic)) ||
+        prefix.version != STAGING_VERSION ||
+        prefix.header_size != sizeof(Header) ||
+        prefix.max_nr_entries > s->global->max_nr_entries ||
+        (size_t)st.st_size != staging_size(prefix.max_nr_entries)) {
+        WARN("staging: ignoring %s, not a staging file of this version",
+             path);
+        return false;
+    }
+
+    void *map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        WARN("staging: can't map %s: %s", path, strerror(errno));
+        return false;
+    }
+    staging_attach(s, map, st.st_size, prefix.max_nr_entries, false);
+
+    Header *h = s->header;
+    bool ok = h->nr_entries <= prefix.max_nr_entries;
+    for (uint32_t i = 0; ok && i < h->nr_entries; ++i) {
+        const Entry *e = &s->store[i];
+        if (e->ip_version == 6 && e->daddr.s_addr < prefix.max_nr_entries) {
+            if (e->daddr.s_addr >= s->daddrs6.size)
+                s->daddrs6.size = e->daddr.s_addr + 1;
+        } else {
+            ok = e->ip_version == 4;
+        }
+    }
+    if (!ok) {
+        WARN("staging: ignoring %s, its entries are corrupted", path);
+        staging_close(s);
+    }
+    return ok;
+}
+
+// Commit the trunk of a previous run as it was when it stopped.  A trunk
+// caught while being committed has its header recomputed: the commit
+// either failed, or completed right before the crash, before the trunk
+// could be marked committed, and the trunk is committed twice.
+static void staging_commit(Committer *c, State *s) {
+    Header *h = s->header;
+    Header recovered = {
+        .nr_entries = h->nr_entries,
+        .raw_size = h->nr_entries * sizeof(Entry),
+        .compression_type = c->g->compression_type,
+        .start_time = h->start_time,
+        .end_time = h->end_time ? h->end_time
+                                : s->store[h->nr_entries - 1].timestamp,
+        .nr_lost = h->nr_lost,
+        .nr_overflows = h->nr_overflows,
+    };
+    *h = recovered;
+
+    void *buf = compress_trunk(c, s, 0);
+    // Exiting rolls the recovery back, leaving the staging files in place
+    if (db_insert(&c->w, h, buf) != SQLITE_DONE)
+        FATAL("staging: can't recover the entries, try again");
+    gc_account(c->g, h->raw_size + g_header_row_size);
+}
+
+// Commit the entries left in staging files by a previous run in one
+// transaction, then remove the files, before the trunks are set up
+// again.  Return the number of trunks recovered.
+uint32_t staging_recover(Global *g) {
+    Committer c;
+    State *trunks = NULL;
+    uint32_t nr_files = 0, nr_recovered = 0;
+    char path[PATH_MAX];
+
+    for (;; ++nr_files) {
+        staging_path(path, sizeof(path), g->storage_file, nr_files);
+        int fd = open(path, O_RDWR);
+        if (fd < 0)
+            break;
+
+        State s = {.global = g};
+        if (staging_load(&s, fd, path)) {
+            if (s.header->nr_entries) {
+                if (!nr_recovered) {
+                    committer_init(&c, g);
+                    db_begin(c.w.db);
+                }
+                INFO("staging: recovering %u entries from %s",
+                     s.header->nr_entries, path);
+                staging_commit(&c, &s);
+                // Kept mapped until the transaction is committed
+                trunks = realloc(trunks, sizeof(State) * (nr_recovered + 1));
+                trunks[nr_recovered++] = s;
+            } else {
+                staging_close(&s);
+            }
+        }
+        close(fd);
+    }
+
+    if (nr_recovered) {
+        committer_store_dict(&c);
+        db_end(c.w.db);
+        committer_use_dict(&c);
+        committer_destroy(&c);
+    }
+    for (uint32_t i = 0; i < nr_recovered; ++i) {
+        staging_committed(&trunks[i]);
+        staging_close(&trunks[i]);
+    }
+    free(trunks);
+    for (uint32_t id = 0; id < nr_files; ++id) {
+        staging_path(path, sizeof(path), g->storage_file, id);
+        unlink(path);
+    }
+    return nr_recovered;
+}
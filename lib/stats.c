@@ -0,0 +1,216 @@
+// Statistics
+//
+// Receive workers, the commit worker and the GC worker each keep their
+// own counters, which a stats worker periodically writes to a file in
+// the Prometheus text format, e.g. for the textfile collector of
+// node_exporter.  The file is replaced as a whole, so readers never see
+// it half written.
+
+#include "stats.h"
+#include "pool.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATS_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+uint64_t stats_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_record(LatencyHistogram *h, uint64_t usec) {
+    // Smallest i such that usec <= 2^i
+    uint32_t i = usec > 1 ? 64 - __builtin_clzll(usec - 1) : 0;
+    if (i >= g_stats_nr_buckets)
+        i = g_stats_nr_buckets - 1;
+    STATS_INC(h->buckets[i]);
+    STATS_INC(h->count);
+    STATS_ADD(h->sum_usec, usec);
+}
+
+static void write_metric(FILE *f, const char *name, const char *type,
+                         const char *help) {
+    fprintf(f, "# HELP nfcollect_%s %s\n# TYPE nfcollect_%s %s\n", name, help,
+            name, type);
+}
+
+// Counters of CollectStats, one line per group.  Counters sharing the
+// name of the previous one only differ by their labels.
+static const struct {
+    const char *name, *labels, *help;
+    size_t offset;
+} group_counters[] = {
+#define GROUP_COUNTER(name, labels, help, field)                               \
+    {name, labels, help, offsetof(CollectStats, field)}
+    GROUP_COUNTER("recvs_total", "", "Netlink messages received", nr_recvs),
+    GROUP_COUNTER("recv_bytes_total", "", "Bytes of netlink messages received",
+                  nr_recv_bytes),
+    GROUP_COUNTER("packets_total", "", "Packets received from the kernel",
+                  nr_packets),
+    GROUP_COUNTER("packets_stored_total", "", "Packets stored as a new entry",
+                  nr_stored),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"rate_limited\"",
+                  "Packets not stored as a new entry, by rule",
+                  nr_rate_limited),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"not_ip\"", NULL,
+                  nr_not_ip),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"not_tcp_udp\"", NULL,
+                  nr_not_tcp_udp),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"ack_only\"", NULL,
+                  nr_ack_only),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"truncated\"", NULL,
+                  nr_truncated),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"no_uid\"", NULL,
+                  nr_no_uid),
+    GROUP_COUNTER("packets_filtered_total", ",rule=\"trunk_full\"", NULL,
+                  nr_trunk_full),
+    GROUP_COUNTER("packets_lost_total", "",
+                  "Packets lost before being stored, in filled trunks",
+                  nr_lost),
+    GROUP_COUNTER("overflows_total", "",
+                  "Receive buffer overflows, in filled trunks", nr_overflows),
+#undef GROUP_COUNTER
+};
+
+static void write_collect_stats(FILE *f, const Global *g) {
+    for (size_t c = 0; c < sizeof(group_counters) / sizeof(*group_counters);
+         ++c) {
+        if (group_counters[c].help)
+            write_metric(f, group_counters[c].name, "counter",
+                         group_counters[c].help);
+        for (uint16_t i = 0; i < g->nr_nl_groups; ++i) {
+            const Netlink *nl = &g->netlinks[i];
+            const uint64_t *counter =
+                (const uint64_t *)((const char *)&nl->stats +
+                                   group_counters[c].offset);
+            fprintf(f, "nfcollect_%s{group=\"%u\"%s} %" PRIu64 "\n",
+                    group_counters[c].name, nl->group_id,
+                    group_counters[c].labels, STATS_READ(*counter));
+        }
+    }
+}
+
+static void write_histogram(FILE *f, const char *name, const char *help,
+                            const LatencyHistogram *h) {
+    uint64_t cumulative = 0;
+    write_metric(f, name, "histogram", help);
+    for (uint32_t i = 0; i < g_stats_nr_buckets - 1; ++i) {
+        cumulative += STATS_READ(h->buckets[i]);
+        fprintf(f, "nfcollect_%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+                name, (double)(1ULL << i) / 1e6, cumulative);
+    }
+    fprintf(f, "nfcollect_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name,
+            STATS_READ(h->count));
+    fprintf(f, "nfcollect_%s_sum %.6f\n", name,
+            STATS_READ(h->sum_usec) / 1e6);
+    fprintf(f, "nfcollect_%s_count %" PRIu64 "\n", name,
+            STATS_READ(h->count));
+}
+
+static void write_gauge(FILE *f, const char *name, const char *help,
+                        double value) {
+    write_metric(f, name, "gauge", help);
+    fprintf(f, "nfcollect_%s %.15g\n", name, value);
+}
+
+static void write_counter(FILE *f, const char *name, const char *help,
+                          uint64_t value) {
+    write_metric(f, name, "counter", help);
+    fprintf(f, "nfcollect_%s %" PRIu64 "\n", name, value);
+}
+
+static void write_commit_stats(FILE *f, Global *g) {
+    Stats *st = &g->stats;
+
+    write_gauge(f, "commit_queue_trunks", "Trunks waiting to be committed",
+                trunk_queue_size(&g->commit_queue));
+    write_gauge(f, "free_trunks", "Trunks waiting to be filled",
+                trunk_queue_size(&g->free_trunks));
+    write_counter(f, "pool_stalls_total",
+                  "Times a receive worker waited for a free trunk",
+                  STATS_READ(g->nr_pool_stalls));
+
+    write_counter(f, "trunks_committed_total", "Trunks committed",
+                  STATS_READ(st->nr_trunks_committed));
+    write_counter(f, "entries_committed_total", "Entries committed",
+                  STATS_READ(st->nr_entries_committed));
+    uint64_t encoded = STATS_READ(st->encoded_bytes),
+             compressed = STATS_READ(st->compressed_bytes);
+    write_counter(f, "raw_bytes_total",
+                  "In-memory size of the committed trunks, before encoding",
+                  STATS_READ(st->raw_bytes));
+    write_counter(f, "encoded_bytes_total",
+                  "Size of the committed trunks encoded in columns, before "
+                  "compression",
+                  encoded);
+    write_counter(f, "compressed_bytes_total",
+                  "Size of the committed trunks after compression",
+                  compressed);
+    write_gauge(f, "compression_ratio",
+                "Encoded over compressed size of the committed trunks, "
+                "the savings of the compressor alone",
+                compressed ? (double)encoded / compressed : 0);
+    write_histogram(f, "compress_seconds", "Time to compress a trunk",
+                    &st->compress_latency);
+    write_histogram(f, "insert_seconds",
+                    "Time to insert a batch of trunks in one transaction",
+                    &st->insert_latency);
+    write_histogram(f, "commit_seconds",
+                    "Time from a trunk being queued until it is committed",
+                    &st->commit_latency);
+
+    pthread_mutex_lock(&g->storage_consumed_lock);
+    int64_t consumed = g->storage_consumed;
+    pthread_mutex_unlock(&g->storage_consumed_lock);
+    write_gauge(f, "storage_budget_bytes", "Storage budget",
+                g->storage_budget);
+    write_gauge(f, "storage_consumed_bytes", "Storage consumed", consumed);
+    write_counter(f, "gc_rounds_total", "GC rounds",
+                  STATS_READ(st->nr_gc_rounds));
+    write_counter(f, "gc_trunks_total", "Trunks recycled by GC",
+                  STATS_READ(st->nr_gc_trunks));
+    write_metric(f, "gc_seconds_total", "counter", "Time spent in GC rounds");
+    fprintf(f, "nfcollect_gc_seconds_total %.6f\n",
+            STATS_READ(st->gc_usec) / 1e6);
+}
+
+// Write the statistics to a temporary file next to stats_file, then
+// rename it over
+void stats_write(Global *g) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.tmp", g->stats_file);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        WARN("stats: can't open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    write_collect_stats(f, g);
+    write_commit_stats(f, g);
+    if (fclose(f) || rename(path, g->stats_file) < 0) {
+        WARN("stats: can't write %s: %s", g->stats_file, strerror(errno));
+        unlink(path);
+    }
+}
+
+// Write the statistics every stats_interval seconds until nfcollect
+// stops, main writes them a last time once everything is committed
+void *stats_worker(void *targs) {
+    Global *g = (Global *)targs;
+    DEBUG("Stats worker #%lu: main loop starts", pthread_self());
+
+    uint32_t elapsed = 0;
+    while (!g->stop) {
+        sleep(1);
+        if (++elapsed >= g->stats_interval) {
+            stats_write(g);
+            elapsed = 0;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,171 @@
+#include "synopsis.h"
+#include <string.h>
+
+// Each field is hashed with its own tag so that e.g. uid 53 and
+// dport 53 set different bits
+enum SynopsisKey {
+    SYNOPSIS_UID = 1,
+    SYNOPSIS_DPORT,
+    SYNOPSIS_DADDR,
+    SYNOPSIS_PROTOCOL,
+    // IPv6 addresses folded to 32 bits, and whether there are any
+    SYNOPSIS_DADDR6,
+    SYNOPSIS_INET6,
+};
+
+#define BLOOM_BITS (g_synopsis_bloom_size * 8)
+
+// splitmix64 finalizer
+static uint64_t synopsis_hash(enum SynopsisKey key, uint32_t value) {
+    uint64_t x = ((uint64_t)key << 32) | value;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// The bits of a value are derived from two halves of one hash
+static void bloom_add(uint8_t *bloom, enum SynopsisKey key, uint32_t value) {
+    uint64_t hash = synopsis_hash(key, value);
+    uint32_t h1 = hash, h2 = hash >> 32;
+    for (uint32_t i = 0; i < g_synopsis_bloom_hashes; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BITS;
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static bool bloom_may_contain(const uint8_t *bloom, enum SynopsisKey key,
+                              uint32_t value) {
+    uint64_t hash = synopsis_hash(key, value);
+    uint32_t h1 = hash, h2 = hash >> 32;
+    for (uint32_t i = 0; i < g_synopsis_bloom_hashes; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BITS;
+        if (!(bloom[bit / 8] & (1 << (bit % 8))))
+            return false;
+    }
+    return true;
+}
+
+static uint32_t fold_inet6(const struct in6_addr *addr) {
+    uint32_t w[4];
+    memcpy(w, addr->s6_addr, sizeof(w));
+    return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+// The address range only covers IPv4 entries, IPv6 addresses are only
+// added to the bloom filter
+void synopsis_build(State *s) {
+    Header *h = s->header;
+    const Entry *store = s->store;
+    Synopsis *syn = &h->synopsis;
+    memset(syn, 0, sizeof(Synopsis));
+    syn->daddr_min = UINT32_MAX;
+    syn->sport_min = syn->dport_min = UINT16_MAX;
+
+    // Consecutive entries often repeat values, which need not be hashed
+    // again
+    uint32_t prev_uid = 0, prev_daddr = 0;
+    uint16_t prev_dport = 0;
+    uint8_t prev_protocol = 0;
+    // The daddr of IPv6 entries is an index into the address table, so
+    // only compare IPv4 entries with the previous IPv4 one
+    bool have_prev_daddr = false;
+    for (uint32_t i = 0; i < h->nr_entries; ++i) {
+        const Entry *e = &store[i];
+        uint32_t daddr = ntohl(e->daddr.s_addr);
+
+        if (e->ip_version == 4) {
+            if (daddr < syn->daddr_min)
+                syn->daddr_min = daddr;
+            if (daddr > syn->daddr_max)
+                syn->daddr_max = daddr;
+        }
+        if (e->sport < syn->sport_min)
+            syn->sport_min = e->sport;
+        if (e->sport > syn->sport_max)
+            syn->sport_max = e->sport;
+        if (e->dport < syn->dport_min)
+            syn->dport_min = e->dport;
+        if (e->dport > syn->dport_max)
+            syn->dport_max = e->dport;
+
+        if (!i || e->uid != prev_uid)
+            bloom_add(syn->bloom, SYNOPSIS_UID, e->uid);
+        if (!i || e->dport != prev_dport)
+            bloom_add(syn->bloom, SYNOPSIS_DPORT, e->dport);
+        if (e->ip_version == 4 && (!have_prev_daddr || daddr != prev_daddr))
+            bloom_add(syn->bloom, SYNOPSIS_DADDR, daddr);
+        if (!i || e->protocol != prev_protocol)
+            bloom_add(syn->bloom, SYNOPSIS_PROTOCOL, e->protocol);
+        prev_uid = e->uid;
+        prev_dport = e->dport;
+        if (e->ip_version == 4) {
+            prev_daddr = daddr;
+            have_prev_daddr = true;
+        }
+        prev_protocol = e->protocol;
+    }
+
+    // IPv6 addresses are distinct already
+    for (uint32_t i = 0; i < s->daddrs6.size; ++i)
+        bloom_add(syn->bloom, SYNOPSIS_DADDR6,
+                  fold_inet6(&s->daddrs6.addrs[i]));
+    if (s->daddrs6.size)
+        bloom_add(syn->bloom, SYNOPSIS_INET6, 0);
+    h->has_synopsis = true;
+}
+
+// Whether the trunk may hold entries matching the filter; false means
+// the trunk can be skipped without being read
+bool synopsis_may_match(const Header *h, const Filter *f) {
+    const Synopsis *syn = &h->synopsis;
+    if (!h->has_synopsis || !f->fields)
+        return true;
+    if (!h->nr_entries)
+        return false;
+
+    if (f->fields & FILTER_UID &&
+        !bloom_may_contain(syn->bloom, SYNOPSIS_UID, f->uid))
+        return false;
+
+    if (f->fields & FILTER_SPORT &&
+        (f->sport_max < syn->sport_min || f->sport_min > syn->sport_max))
+        return false;
+
+    if (f->fields & FILTER_DPORT) {
+        if (f->dport_max < syn->dport_min || f->dport_min > syn->dport_max)
+            return false;
+        if (f->dport_min == f->dport_max &&
+            !bloom_may_contain(syn->bloom, SYNOPSIS_DPORT, f->dport_min))
+            return false;
+    }
+
+    if (f->fields & FILTER_DADDR && f->daddr_version == 6) {
+        if (!bloom_may_contain(syn->bloom, SYNOPSIS_INET6, 0))
+            return false;
+        uint8_t full[16];
+        memset(full, 0xff, sizeof(full));
+        if (!memcmp(&f->daddr6_mask, full, sizeof(full)) &&
+            !bloom_may_contain(syn->bloom, SYNOPSIS_DADDR6,
+                               fold_inet6(&f->daddr6)))
+            return false;
+    }
+
+    if (f->fields & FILTER_DADDR && f->daddr_version == 4) {
+        uint32_t mask = ntohl(f->daddr_mask);
+        uint32_t first = ntohl(f->daddr), last = first | ~mask;
+        if (last < syn->daddr_min || first > syn->daddr_max)
+            return false;
+        if (mask == UINT32_MAX &&
+            !bloom_may_contain(syn->bloom, SYNOPSIS_DADDR, first))
+            return false;
+    }
+
+    if (f->fields & FILTER_PROTOCOL &&
+        !bloom_may_contain(syn->bloom, SYNOPSIS_PROTOCOL, f->protocol))
+        return false;
+
+    return true;
+}
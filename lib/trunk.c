@@ -0,0 +1,419 @@
+// Columnar trunk layout (TRUNK_FORMAT_COLUMNAR)
+//
+// Instead of an array of packed Entry rows, a trunk is stored column by
+// column, each column being a plain array in host byte order:
+//
+//   ColumnarHeader
+//   uint32_t time[nr_entries]         seconds since header->start_time
+//   uint32_t uid_dict[nr_uids]        distinct uids of the trunk
+//   uintN_t  uid[nr_entries]          index into uid_dict
+//   uint32_t daddr_dict[nr_daddrs]    distinct destination addresses
+//   uintN_t  daddr[nr_entries]        index into daddr_dict
+//   uint16_t sport[nr_entries]
+//   uint16_t dport[nr_entries]
+//   uint8_t  protocol[nr_entries]
+//
+// where the width N of dictionary indices (1, 2 or 4 bytes) is the
+// smallest one able to address the dictionary.  Similar values end up
+// next to each other, which compresses much better than rows do.
+//
+// TRUNK_FORMAT_COLUMNAR_MSEC trunks have millisecond timestamps: the
+// time column is moved after the protocol column, each entry being the
+// difference in milliseconds to the previous one (to the start of the
+// trunk for the first one), zigzag and varint encoded.  Entries are
+// received in order, so this takes a byte or two per entry.
+//
+// TRUNK_FORMAT_COLUMNAR_COUNT trunks add the packet count of each entry
+// minus one, varint encoded, after the time column.
+//
+// TRUNK_FORMAT_COLUMNAR_INET6 trunks end with the IPv6 address table of
+// the trunk, see lib/inet6.c:
+//
+//   uint32_t nr_daddrs6
+//   uint8_t  ip_version[nr_entries]   only if nr_daddrs6 > 0
+//   struct in6_addr daddr6[nr_daddrs6]
+//
+// so that trunks without any IPv6 entry only take four more bytes.
+
+#include "trunk.h"
+#include "inet6.h"
+#include "main.h"
+#include <stddef.h>
+#include <string.h>
+
+typedef struct __attribute__((packed)) _ColumnarHeader {
+    uint32_t nr_entries;
+    uint32_t nr_uids;
+    uint32_t nr_daddrs;
+    uint8_t uid_width;
+    uint8_t daddr_width;
+    uint16_t __unused;
+} ColumnarHeader;
+
+typedef struct _Dict {
+    uint64_t *keys;   // value + 1 of each slot, 0 if the slot is empty
+    uint32_t *index;  // dictionary index of each slot
+    uint32_t mask;
+    uint32_t *values; // dictionary, in order of first appearance
+    uint32_t size;
+} Dict;
+
+static void dict_init(Dict *d, uint32_t nr_entries) {
+    uint32_t nr_slots = 16;
+    while (nr_slots < nr_entries * 2)
+        nr_slots <<= 1;
+    d->keys = calloc(nr_slots, sizeof(uint64_t));
+    d->index = malloc(nr_slots * sizeof(uint32_t));
+    d->values = malloc(nr_entries * sizeof(uint32_t));
+    d->mask = nr_slots - 1;
+    d->size = 0;
+}
+
+static void dict_free(Dict *d) {
+    free(d->keys);
+    free(d->index);
+    free(d->values);
+}
+
+// Return the dictionary index of `value`, adding it if needed
+static uint32_t dict_lookup(Dict *d, uint32_t value) {
+    uint64_t key = (uint64_t)value + 1;
+    uint32_t h = (value * 2654435761u) & d->mask;
+    while (d->keys[h]) {
+        if (d->keys[h] == key)
+            return d->index[h];
+        h = (h + 1) & d->mask;
+    }
+
+    d->keys[h] = key;
+    d->index[h] = d->size;
+    d->values[d->size] = value;
+    return d->size++;
+}
+
+// Columns are not necessarily aligned (neither is the blob handed
+// out by sqlite), so always access them through memcpy
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint16_t load16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store32(uint8_t *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+
+static inline void store16(uint8_t *p, uint16_t v) { memcpy(p, &v, sizeof(v)); }
+
+static uint8_t index_width(uint32_t dict_size) {
+    if (dict_size <= 1u << 8)
+        return 1;
+    if (dict_size <= 1u << 16)
+        return 2;
+    return 4;
+}
+
+static void put_index(uint8_t *dst, uint8_t width, uint32_t i, uint32_t v) {
+    switch (width) {
+    case 1:
+        dst[i] = v;
+        break;
+    case 2:
+        store16(dst + i * 2, v);
+        break;
+    default:
+        store32(dst + i * 4, v);
+    }
+}
+
+static uint32_t get_index(const uint8_t *src, uint8_t width, uint32_t i) {
+    switch (width) {
+    case 1:
+        return src[i];
+    case 2:
+        return load16(src + i * 2);
+    default:
+        return load32(src + i * 4);
+    }
+}
+
+// At most 10 bytes for a 64-bit value
+#define VARINT_MAX 10
+
+static uint8_t *put_uvarint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint8_t *put_varint(uint8_t *p, int64_t v) {
+    return put_uvarint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+// Return NULL if the varint runs past `end`
+static const uint8_t *get_uvarint(const uint8_t *p, const uint8_t *end,
+                                  uint64_t *v) {
+    uint64_t z = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        z |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = z;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+                                 int64_t *v) {
+    uint64_t z;
+    p = get_uvarint(p, end, &z);
+    *v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    return p;
+}
+
+size_t trunk_encode_bound(uint32_t nr_entries) {
+    // Worst case: every uid and daddr is distinct and needs 4 byte
+    // indices, times and counts take the longest varints and every
+    // entry has its own IPv6 address
+    return sizeof(ColumnarHeader) + sizeof(uint32_t) +
+           (size_t)nr_entries *
+               (VARINT_MAX * 2 + sizeof(uint32_t) * 4 + sizeof(uint16_t) * 2 +
+                sizeof(uint8_t) * 2 + sizeof(struct in6_addr));
+}
+
+// Encode the trunk into `dst` in TRUNK_FORMAT_COLUMNAR_INET6, which must
+// hold at least trunk_encode_bound() bytes.  Return the encoded size.
+size_t trunk_encode(const State *s, void *dst) {
+    const Header *header = s->header;
+    const Entry *store = s->store;
+    const Inet6Table *daddrs6 = &s->daddrs6;
+    uint32_t n = header->nr_entries;
+    ColumnarHeader *ch = (ColumnarHeader *)dst;
+    uint8_t *p = (uint8_t *)dst + sizeof(ColumnarHeader);
+    Dict uids, daddrs;
+
+    // Dictionary indices are computed before knowing the dictionary
+    // size, so keep them aside and narrow them afterwards
+    uint32_t *uid_index = malloc(n * sizeof(uint32_t) * 2);
+    uint32_t *daddr_index = uid_index + n;
+    dict_init(&uids, n);
+    dict_init(&daddrs, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        uid_index[i] = dict_lookup(&uids, store[i].uid);
+        daddr_index[i] = dict_lookup(&daddrs, store[i].daddr.s_addr);
+    }
+
+    ch->nr_entries = n;
+    ch->nr_uids = uids.size;
+    ch->nr_daddrs = daddrs.size;
+    ch->uid_width = index_width(uids.size);
+    ch->daddr_width = index_width(daddrs.size);
+    ch->__unused = 0;
+
+    memcpy(p, uids.values, uids.size * sizeof(uint32_t));
+    p += uids.size * sizeof(uint32_t);
+    for (uint32_t i = 0; i < n; ++i)
+        put_index(p, ch->uid_width, i, uid_index[i]);
+    p += n * ch->uid_width;
+
+    memcpy(p, daddrs.values, daddrs.size * sizeof(uint32_t));
+    p += daddrs.size * sizeof(uint32_t);
+    for (uint32_t i = 0; i < n; ++i)
+        put_index(p, ch->daddr_width, i, daddr_index[i]);
+    p += n * ch->daddr_width;
+
+    for (uint32_t i = 0; i < n; ++i)
+        store16(p + i * 2, store[i].sport);
+    p += n * sizeof(uint16_t);
+
+    for (uint32_t i = 0; i < n; ++i)
+        store16(p + i * 2, store[i].dport);
+    p += n * sizeof(uint16_t);
+
+    for (uint32_t i = 0; i < n; ++i)
+        p[i] = store[i].protocol;
+    p += n;
+
+    // Entries are never older than their trunk, which holds even for
+    // trunks recovered from staging files of a previous run
+    int64_t start = (int64_t)header->start_time * 1000, prev = start;
+    for (uint32_t i = 0; i < n; ++i) {
+        int64_t t = ENTRY_TIME_MSEC(&store[i]);
+        if (unlikely(t < start))
+            t = start;
+        p = put_varint(p, t - prev);
+        prev = t;
+    }
+
+    for (uint32_t i = 0; i < n; ++i)
+        p = put_uvarint(p, store[i].count - 1);
+
+    store32(p, daddrs6->size);
+    p += sizeof(uint32_t);
+    if (daddrs6->size) {
+        for (uint32_t i = 0; i < n; ++i)
+            p[i] = store[i].ip_version;
+        p += n;
+        memcpy(p, daddrs6->addrs, daddrs6->size * sizeof(struct in6_addr));
+        p += daddrs6->size * sizeof(struct in6_addr);
+    }
+
+    dict_free(&uids);
+    dict_free(&daddrs);
+    free(uid_index);
+    return p - (uint8_t *)dst;
+}
+
+// Decode `size` bytes of a columnar trunk, in any format, into s->store,
+// which must hold s->header->nr_entries entries, and s->daddrs6.  Return
+// false if the data is malformed.
+bool trunk_decode(State *s, const void *src, size_t size) {
+    const Header *header = s->header;
+    Entry *store = s->store;
+    ColumnarHeader ch;
+    const uint8_t *p = (const uint8_t *)src + sizeof(ColumnarHeader);
+    const uint8_t *end = (const uint8_t *)src + size;
+    uint32_t n = header->nr_entries;
+    bool msec = header->format >= TRUNK_FORMAT_COLUMNAR_MSEC;
+    bool count = header->format >= TRUNK_FORMAT_COLUMNAR_COUNT;
+    bool inet6 = header->format >= TRUNK_FORMAT_COLUMNAR_INET6;
+
+    if (size < sizeof(ColumnarHeader)) {
+        WARN("trunk: columnar trunk too short: %lu", size);
+        return false;
+    }
+    memcpy(&ch, src, sizeof(ColumnarHeader));
+    if (ch.nr_entries != n || ch.nr_uids > n || ch.nr_daddrs > n ||
+        ch.uid_width != index_width(ch.nr_uids) ||
+        ch.daddr_width != index_width(ch.nr_daddrs)) {
+        WARN("trunk: malformed columnar header");
+        return false;
+    }
+
+    // Varint columns have no fixed size, they take the rest
+    size_t expected = sizeof(ColumnarHeader) +
+                      (size_t)n * ((msec ? 0 : sizeof(uint32_t)) +
+                                   ch.uid_width + ch.daddr_width +
+                                   sizeof(uint16_t) * 2 + sizeof(uint8_t)) +
+                      (size_t)(ch.nr_uids + ch.nr_daddrs) * sizeof(uint32_t);
+    if (msec ? size < expected + n * (count ? 2 : 1) +
+                          (inet6 ? sizeof(uint32_t) : 0)
+             : size != expected) {
+        WARN("trunk: expected columnar size: %lu, got: %lu", expected, size);
+        return false;
+    }
+
+    memset(store, 0, n * sizeof(Entry));
+
+    if (!msec) {
+        for (uint32_t i = 0; i < n; ++i)
+            store[i].timestamp = header->start_time + load32(p + i * 4);
+        p += n * sizeof(uint32_t);
+    }
+
+    const uint8_t *uid_dict = p;
+    p += ch.nr_uids * sizeof(uint32_t);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t idx = get_index(p, ch.uid_width, i);
+        if (unlikely(idx >= ch.nr_uids))
+            return false;
+        store[i].uid = load32(uid_dict + idx * 4);
+    }
+    p += n * ch.uid_width;
+
+    const uint8_t *daddr_dict = p;
+    p += ch.nr_daddrs * sizeof(uint32_t);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t idx = get_index(p, ch.daddr_width, i);
+        if (unlikely(idx >= ch.nr_daddrs))
+            return false;
+        store[i].daddr.s_addr = load32(daddr_dict + idx * 4);
+    }
+    p += n * ch.daddr_width;
+
+    for (uint32_t i = 0; i < n; ++i)
+        store[i].sport = load16(p + i * 2);
+    p += n * sizeof(uint16_t);
+
+    for (uint32_t i = 0; i < n; ++i)
+        store[i].dport = load16(p + i * 2);
+    p += n * sizeof(uint16_t);
+
+    for (uint32_t i = 0; i < n; ++i)
+        store[i].protocol = p[i];
+    p += n;
+
+    if (msec) {
+        int64_t t = (int64_t)header->start_time * 1000;
+        for (uint32_t i = 0; i < n; ++i) {
+            int64_t delta;
+            if (unlikely(!(p = get_varint(p, end, &delta)))) {
+                WARN("trunk: truncated time column");
+                return false;
+            }
+            t += delta;
+            // Floor division, times before 1970 being negative
+            int64_t sec = t / 1000 - (t % 1000 < 0);
+            store[i].timestamp = sec;
+            store[i].msec = t - sec * 1000;
+        }
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t c = 0;
+        if (count && unlikely(!(p = get_uvarint(p, end, &c)) ||
+                              c >= UINT32_MAX)) {
+            WARN("trunk: malformed count column");
+            return false;
+        }
+        store[i].count = c + 1;
+        store[i].ip_version = 4;
+    }
+
+    inet6_table_reserve(&s->daddrs6, 0);
+    if (inet6) {
+        if (unlikely(end - p < (ptrdiff_t)sizeof(uint32_t))) {
+            WARN("trunk: truncated IPv6 address table");
+            return false;
+        }
+        uint32_t nr_daddrs6 = load32(p);
+        p += sizeof(uint32_t);
+        if (nr_daddrs6) {
+            if (nr_daddrs6 > n ||
+                (size_t)(end - p) != n + nr_daddrs6 * sizeof(struct in6_addr)) {
+                WARN("trunk: malformed IPv6 address table");
+                return false;
+            }
+            for (uint32_t i = 0; i < n; ++i) {
+                store[i].ip_version = p[i];
+                if (unlikely(p[i] == 6 ? store[i].daddr.s_addr >= nr_daddrs6
+                                       : p[i] != 4)) {
+                    WARN("trunk: malformed IP version column");
+                    return false;
+                }
+            }
+            p += n;
+            inet6_table_reserve(&s->daddrs6, nr_daddrs6);
+            memcpy(s->daddrs6.addrs, p, nr_daddrs6 * sizeof(struct in6_addr));
+            s->daddrs6.size = nr_daddrs6;
+            p += nr_daddrs6 * sizeof(struct in6_addr);
+        }
+    }
+
+    if (msec && p != end) {
+        WARN("trunk: %lu trailing bytes after the last column",
+             (size_t)(end - p));
+        return false;
+    }
+
+    return true;
+}
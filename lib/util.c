@@ -1,5 +1,6 @@
 
 #include "main.h"
+#include <errno.h>
 #include <libgen.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -32,6 +33,8 @@ enum CompressionType get_compression(const char *flag) {
         return COMPRESS_ZSTD;
     } else if (!strcmp(flag, "lz4")) {
         return COMPRESS_LZ4;
+    } else if (!strcmp(flag, "lz4hc")) {
+        return COMPRESS_LZ4HC;
     } else {
         FATAL("Unknown compression algorithm: %s\n", flag);
         exit(1);
@@ -39,3 +42,27 @@ enum CompressionType get_compression(const char *flag) {
 
     return 0;
 }
+
+uint16_t get_nflog_groups(const char *flag, uint16_t **groups,
+                          uint16_t nr_groups) {
+    // Accept a comma separated list of group ids, e.g. "5,6,7"
+    char *_flag = strdup(flag), *saveptr = NULL;
+    for (char *tok = strtok_r(_flag, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *end;
+        errno = 0;
+        long id = strtol(tok, &end, 10);
+        if (errno || *end || end == tok || id < 0 || id > UINT16_MAX)
+            FATAL("Invalid nflog group: %s", tok);
+
+        for (uint16_t i = 0; i < nr_groups; ++i)
+            if ((*groups)[i] == id)
+                FATAL("Duplicated nflog group: %ld", id);
+
+        *groups = realloc(*groups, sizeof(uint16_t) * (nr_groups + 1));
+        (*groups)[nr_groups++] = (uint16_t)id;
+    }
+
+    free(_flag);
+    return nr_groups;
+}